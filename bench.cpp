@@ -0,0 +1,123 @@
+/*
+
+An implementation of the RFC 6238 time based OTP protocol on an AtTiny85 microcontroller
+
+Copyright (C) 2017 Adam Reid
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+/*
+Host benchmark for the SHA1 and HMAC_SHA1 code shared with the firmware, and
+for checking a window of five TOTP steps one HMAC at a time or with otpWindow().
+
+Build and run with: make bench
+*/
+
+#include "hmac_sha1.h"
+#include "otp.h"
+#include "sha1_multi.h"
+#include <chrono>
+#include <stdio.h>
+
+typedef std::chrono::steady_clock Clock;
+
+static double seconds(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+//Runs f in batches until at least a second has passed, returns calls per second
+template<class F> static double rate(F f)
+{
+    unsigned long calls = 0;
+    Clock::time_point start = Clock::now();
+    double elapsed;
+    do
+    {
+        for(int i = 0; i < 10000; i++) f();
+        calls += 10000;
+        elapsed = seconds(start);
+    } while(elapsed < 1.0);
+    return calls / elapsed;
+}
+
+int main()
+{
+    uint8_t block[64];
+    for(uint8_t i = 0; i < 64; i++) block[i] = i;
+    uint8_t key[20];
+    for(uint8_t i = 0; i < 20; i++) key[i] = 0xa5 ^ i;
+    uint8_t counter[8] = {0, 0, 0, 0, 0x03, 0x1f, 0x2e, 0x9b};
+    uint8_t hash[20];
+
+    SHA1 sha1;
+    double compressions = rate([&]{ sha1.update(block, 64); });
+    sha1.digest(hash);
+    printf("SHA1 %-6s compressions/sec:       %10.0f\n", SHA1::engine(), compressions);
+
+    double keyed = rate([&]{
+        HMAC_SHA1 hmac(key, sizeof(key));
+        hmac.update(counter, 8);
+        hmac.digest(key, sizeof(key), hash);
+        counter[7]++;
+    });
+    printf("HMAC_SHA1 (key) HMACs/sec:      %12.0f\n", keyed);
+
+    HMAC_SHA1_Midstate mid;
+    HMAC_SHA1::midstate(key, sizeof(key), mid);
+    double resumed = rate([&]{
+        HMAC_SHA1 hmac(mid);
+        hmac.update(counter, 8);
+        hmac.digest(mid, hash);
+        counter[7]++;
+    });
+    printf("HMAC_SHA1 (midstate) HMACs/sec: %12.0f\n", resumed);
+
+    //Multi-buffer engines, reported as single block compressions
+    uint32_t states[64][5] = {};
+    const uint8_t* blocks[64];
+    for(uint8_t i = 0; i < 64; i++) blocks[i] = block;
+    uint32_t wordStates[5][16] = {};
+    uint32_t W[16][16];
+    for(uint8_t t = 0; t < 16; t++) for(uint8_t i = 0; i < 16; i++) W[t][i] = t * 4;
+    for(uint8_t lanes = 4; lanes <= 16; lanes *= 2)
+    {
+        SHA1_Multi multi(lanes);
+        if(multi.lanes() != lanes) continue;
+        double batches = rate([&]{ multi.compress(states, blocks, 64); });
+        printf("SHA1_Multi %-6s compressions/sec: %10.0f\n", multi.name(), batches * 64);
+        double words = rate([&]{ multi.compressWords(wordStates, W, 16); });
+        printf("SHA1_Multi %-6s words/sec:        %10.0f\n", multi.name(), words * 16);
+    }
+
+    //A window of two steps either side
+    uint8_t passwords[5 * 6];
+    double scalarWindows = rate([&]{
+        for(uint8_t i = 0; i < 5; i++)
+        {
+            counter[7]++;
+            otp(&passwords[i * 6], mid, counter);
+        }
+    });
+    printf("otp window of 5 windows/sec:    %12.0f\n", scalarWindows);
+    SHA1_Multi window;
+    uint64_t step = 0;
+    double batchedWindows = rate([&]{ otpWindow(passwords, mid, step++, 5, 6, window); });
+    printf("otpWindow %-6s windows/sec:   %12.0f\n", window.name(), batchedWindows);
+
+    return 0;
+}
@@ -0,0 +1,51 @@
+/*
+
+An implementation of the RFC 6238 time based OTP protocol on an AtTiny85 microcontroller
+
+Copyright (C) 2017 Adam Reid
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#include "drift_table.h"
+#include "user_hash.h"
+
+OTP_DriftTable::OTP_DriftTable(size_t entries)
+{
+    uint64_t slots = 1;
+    while(slots < entries) slots <<= 1;
+    mEntries.reset(new std::atomic<uint64_t>[slots]);
+    for(uint64_t i = 0; i < slots; i++) mEntries[i].store(0, std::memory_order_relaxed);
+    mMask = slots - 1;
+}
+
+//Users not in the table have no drift
+int8_t OTP_DriftTable::get(uint64_t user) const
+{
+    uint64_t h = userHash(user);
+    uint64_t e = mEntries[h & mMask].load(std::memory_order_relaxed);
+    if((e ^ h) >> 8) return 0;
+    return (int8_t)e;
+}
+
+void OTP_DriftTable::set(uint64_t user, int8_t steps)
+{
+    uint64_t h = userHash(user);
+    std::atomic<uint64_t>& e = mEntries[h & mMask];
+    //No drift is the default, don't evict another token to record it
+    if(!steps && (e.load(std::memory_order_relaxed) ^ h) >> 8) return;
+    e.store((h & ~0xffull) | (uint8_t)steps, std::memory_order_relaxed);
+}
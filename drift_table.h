@@ -0,0 +1,55 @@
+/*
+
+An implementation of the RFC 6238 time based OTP protocol on an AtTiny85 microcontroller
+
+Copyright (C) 2017 Adam Reid
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#ifndef _DRIFT_TABLE_H_
+#define _DRIFT_TABLE_H_
+
+#include <atomic>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+Clock drift of each token for the host verifier, as the time step offset its
+last code matched at. OTP_Verifier tries that offset first and only works
+outwards from it on a miss, so a token whose RTC runs a step off still costs
+one HMAC per code. The window around the server's step is not moved.
+
+The table is direct mapped, one atomic 64 bit entry per slot holding 56 bits of
+a hash of the user and the offset, with no locks. Users that share a slot
+overwrite each other, which only costs the loser a wider search, so size it
+for the number of tokens.
+*/
+
+class OTP_DriftTable
+{
+    public:
+    OTP_DriftTable(size_t entries);
+    int8_t get(uint64_t user) const;
+    void set(uint64_t user, int8_t steps);
+
+    private:
+    std::unique_ptr<std::atomic<uint64_t>[]> mEntries;
+    uint64_t mMask;
+};
+
+#endif
@@ -17,7 +17,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 */
 #include "hmac_sha1.h"
-#include <avr/pgmspace.h>
+#include "progmem.h"
 
 
 const PROGMEM uint8_t ipad = '\x36';
@@ -28,18 +28,42 @@ HMAC_SHA1::HMAC_SHA1(const uint8_t* key, uint8_t length)
     reset(key, length);
 }
 
-void HMAC_SHA1::reset(const uint8_t* key, uint8_t length)
+HMAC_SHA1::HMAC_SHA1(const HMAC_SHA1_Midstate& key)
 {
+    reset(key);
+}
+
+//Off the AVR the whole padded key block is built so SHA1 compresses it in one
+//call. The AVR only pads a key when a secret is provisioned, so it feeds the
+//bytes one at a time rather than put another 64 bytes on the stack
+void HMAC_SHA1::pad(const uint8_t* key, uint8_t length, uint8_t p)
+{
+#ifdef __AVR__
     for(uint8_t i=0; i<length; i++)
     {
-        uint8_t ki = key[i] ^ ipad;
+        uint8_t ki = key[i] ^ p;
         mSHA1.update(&ki, 1);
     }
-    uint8_t ki = ipad;
-    for(uint8_t i=0; i<64-length; i++) mSHA1.update(&ki, 1);
+    for(uint8_t i=0; i<64-length; i++) mSHA1.update(&p, 1);
+#else
+    uint8_t block[64];
+    for(uint8_t i=0; i<64; i++) block[i] = i < length ? key[i] ^ p : p;
+    mSHA1.update(block, 64);
+#endif
+}
+
+void HMAC_SHA1::reset(const uint8_t* key, uint8_t length)
+{
+    mSHA1.reset();
+    pad(key, length, ipad);
 }
 
-void HMAC_SHA1::update(const uint8_t* m, uint8_t length)
+void HMAC_SHA1::reset(const HMAC_SHA1_Midstate& key)
+{
+    mSHA1.reset(key.inner, 1);
+}
+
+void HMAC_SHA1::update(const uint8_t* m, sha1_length_t length)
 {
     mSHA1.update(m, length);
 }
@@ -48,16 +72,50 @@ void HMAC_SHA1::digest(const uint8_t* key, uint8_t length, uint8_t hash[20])
 {
     mSHA1.digest(hash);
     mSHA1.reset();
+    pad(key, length, opad);
 
-    for(uint8_t i=0; i<length; i++)
-    {
-        uint8_t ki = key[i] ^ opad;
-        mSHA1.update(&ki, 1);
-    }
-    uint8_t ki = opad;
-    for(uint8_t i=0; i<64-length; i++) mSHA1.update(&ki, 1);
+    mSHA1.update(hash, 20);
+    mSHA1.digest(hash);
+}
+
+void HMAC_SHA1::digest(const HMAC_SHA1_Midstate& key, uint8_t hash[20])
+{
+    mSHA1.digest(hash);
+    mSHA1.reset(key.outer, 1);
 
     mSHA1.update(hash, 20);
     mSHA1.digest(hash);
 }
 
+void HMAC_SHA1::digestBegin(HMAC_SHA1_Resume& r)
+{
+    mSHA1.digestBegin(r.sha1);
+    r.outer = 0;
+}
+
+bool HMAC_SHA1::digestStep(HMAC_SHA1_Resume& r, const HMAC_SHA1_Midstate& key, uint8_t hash[20], uint8_t rounds)
+{
+    if(!mSHA1.digestStep(r.sha1, hash, rounds)) return false;
+    if(r.outer) return true;
+
+    mSHA1.reset(key.outer, 1);
+    mSHA1.update(hash, 20);
+    mSHA1.digestBegin(r.sha1);
+    r.outer = 1;
+    return false;
+}
+
+void HMAC_SHA1::midstate(const uint8_t* key, uint8_t length, HMAC_SHA1_Midstate& state)
+{
+    HMAC_SHA1 hmac;
+    hmac.keyMidstate(key, length, state);
+}
+
+void HMAC_SHA1::keyMidstate(const uint8_t* key, uint8_t length, HMAC_SHA1_Midstate& state)
+{
+    reset(key, length);
+    mSHA1.midstate(state.inner);
+    mSHA1.reset();
+    pad(key, length, opad);
+    mSHA1.midstate(state.outer);
+}
@@ -35,18 +35,51 @@ provide it twice!
 
 Does not support keys longer than 64 bytes since that requires an extra SHA1 hash
 
+If the same key is used for many messages, compute its midstate once with
+HMAC_SHA1::midstate() and pass that instead of the key. The midstate is the
+SHA1 chaining state after the key XOR ipad and key XOR opad blocks, so each
+message then costs two SHA1 compressions less. The midstate is as sensitive
+as the key itself. keyMidstate() does the same with the object's own hash
+state, for callers that can't afford a second HMAC_SHA1 on the stack.
+
+With a midstate the digest can be run in slices like SHA1::digestStep(), see
+sha1.h. digestStep() returns true once both the inner and outer hash are done.
+
 */
 
+struct HMAC_SHA1_Midstate
+{
+    uint32_t inner[5];
+    uint32_t outer[5];
+};
+
+struct HMAC_SHA1_Resume
+{
+    SHA1Resume sha1;
+    uint8_t outer;
+};
+
 class HMAC_SHA1
 {
     public:
+    HMAC_SHA1() {}
     HMAC_SHA1(const uint8_t* key, uint8_t length);
+    HMAC_SHA1(const HMAC_SHA1_Midstate& key);
     void reset(const uint8_t* key, uint8_t length);
-    void update(const uint8_t* m, uint8_t length);
+    void reset(const HMAC_SHA1_Midstate& key);
+    void update(const uint8_t* m, sha1_length_t length);
     void digest(const uint8_t* key, uint8_t length, uint8_t hash[20]);
+    void digest(const HMAC_SHA1_Midstate& key, uint8_t hash[20]);
+    void digestBegin(HMAC_SHA1_Resume& r);
+    bool digestStep(HMAC_SHA1_Resume& r, const HMAC_SHA1_Midstate& key, uint8_t hash[20], uint8_t rounds);
+
+    static void midstate(const uint8_t* key, uint8_t length, HMAC_SHA1_Midstate& state);
+    void keyMidstate(const uint8_t* key, uint8_t length, HMAC_SHA1_Midstate& state);
 
     private:
     SHA1 mSHA1;
+
+    void pad(const uint8_t* key, uint8_t length, uint8_t p);
 };
 
 #endif
@@ -19,11 +19,16 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 
 */
-#include "hmac_sha1.h"
+#include "otp.h"
 #include <avr/eeprom.h>
 #include <util/delay.h>
 #include <avr/wdt.h>
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
+#include "sim/markers.h"
 
 extern "C" {
     #include "usbdrv/usbdrv.h"
@@ -32,16 +37,25 @@ extern "C" {
 
 
 
+//No reserved byte, so the report with its ID fits one 8 byte low speed packet
 struct KeyboardReport{
-        KeyboardReport(): report_id(1), modifier(0), reserved(0)
+        KeyboardReport(): report_id(1), modifier(0)
         {
-            for(uint8_t i=0; i<6; i++) keycode[i] = 0;
+            clear();
         }
         uint8_t& operator[](uint8_t i){return keycode[i];}
+        void clear()
+        {
+            for(uint8_t i=0; i<6; i++) keycode[i] = 0;
+        }
+        bool holds(uint8_t key)
+        {
+            for(uint8_t i=0; i<6; i++) if(keycode[i] == key) return true;
+            return false;
+        }
 
         uint8_t report_id;
         uint8_t modifier;
-        uint8_t reserved;
         uint8_t keycode[6];
 };
 
@@ -53,72 +67,73 @@ uint8_t idleRate = 0xff;
 #define SEND 2
 #define RELEASE 3
 #define SET_TIME 4
+#define SET_SECRET 5
+#define SELECT_SLOT 6
+#define SET_TYPING 7
 uint8_t state = WAIT;
+//A command that arrives while a code is typed waits here until the keys
+//are released, so the host never sees a key left held
+uint8_t pending = WAIT;
 uint8_t holdCounter = 0;
 uint8_t charIndex = 0;
 
-uint8_t password[6];
-uint8_t time[10];
-uint8_t secret[42];
-
-uint8_t reportId;
-uint8_t writeCount;
-
-void otp(uint8_t password[6], uint8_t secret[], uint8_t length, uint8_t time[8])
+//Typing keeps the digits already sent held and adds one key per report, so the
+//host sees exactly one new key each poll and can't reorder them. A repeated
+//digit or a full report needs a release report first. Build with TYPE_ENTER=1
+//to press Enter after the code by default.
+#ifndef TYPE_ENTER
+#define TYPE_ENTER 0
+#endif
+#define KEY_ENTER 40
+uint8_t keyCount = 0;
+
+//Typing settings from feature report 6, kept in EEPROM. interval is the poll
+//interval of the keyboard endpoint in ms and gap the extra ms between reports.
+//TYPING_RELEASE sends a release after every key for hosts that drop held keys.
+//A key held longer than TYPING_HOLD_MS could reach the host's typematic delay
+//and repeat, so slower settings always release and the gap follows the release.
+#define TYPING_ENTER 1
+#define TYPING_RELEASE 2
+#define TYPING_HOLD_MS 200
+
+struct TypingConfig
 {
-    HMAC_SHA1 hmac(secret, length);
-    hmac.update(time, 8);
-
-    uint8_t digest[20];
-    hmac.digest(secret, length, digest);
-
-    uint8_t o = digest[19] & 0x0f;
-    
-    digest[o] &= 0x7f;
-    uint32_t p = 0;
-    for(uint8_t i=0; i<4; i++){
-        uint32_t x = digest[o+i];
-        p |= x << (3-i)*8;
-    } 
-    p = p % 1000000ul;
+    uint8_t interval;
+    uint8_t gap;
+    uint8_t flags;
+};
 
-    for(uint8_t i=0; i<6; i++){
-        password[5-i] = (p%10ul) + 48ul;
-        p /= 10ul;
-    }
-}
+TypingConfig typing;
+//Counts the gap down, 1 ms per Timer1 tick
+volatile uint8_t typeWait;
 
-void setTime(void)
-{
-    time[0] = (0x68<<TWI_ADR_BITS) | (FALSE<<TWI_READ_BIT);
-    time[1] = 0;
-    //wdt_reset();
-    USI_TWI_Start_Transceiver_With_Data( time, 10 );
-}
+uint8_t password[8];
+uint8_t time[8];
+//Feature report 3 to 6 data, also the GET_REPORT 5 and 6 replies and the
+//configuration descriptor
+uint8_t secret[61];
 
-void getClockTime(void)
-{
-    for(uint8_t i=0; i<10; i++) time[i] = 0xaa;
-    
-    time[0] = (0x68<<TWI_ADR_BITS) | (FALSE<<TWI_READ_BIT);
-    time[1] = 0;
+//RTC registers 0-7 behind the report ID, returned by GET_REPORT 2
+uint8_t clockRegs[9] = {2};
+//SET_REPORT 2 data, the report ID then registers 0-7. It waits here for the
+//TWI bus, where a GET_REPORT or descriptor request can't overwrite it
+uint8_t newTime[9];
+//TWI message: address, register pointer and registers 0-7
+uint8_t rtc[10];
 
-    USI_TWI_Start_Transceiver_With_Data( time, 2 );
-    _delay_ms(10);
-    time[0] = (0x68<<TWI_ADR_BITS) | (TRUE<<TWI_READ_BIT);
-    USI_TWI_Start_Transceiver_With_Data( time, 8 );
-}
+uint8_t reportId;
+uint8_t writeCount;
 
-void getTimestamp(void)
+//Unix time in seconds from the BCD registers in clockRegs
+uint32_t clockSeconds(void)
 {
-    getClockTime();
     //year
-    uint8_t y = ((time[7]>>4)&0x0f)*10 + (time[7]&0x0f);
+    uint8_t y = ((clockRegs[7]>>4)&0x0f)*10 + (clockRegs[7]&0x0f);
     uint32_t u = (y+31)/4;
     u += ((uint32_t) (y+30))*365;
 
     //month
-    uint8_t b = ((time[6]>>4)&0x01)*10 + (time[6]&0x0f);
+    uint8_t b = ((clockRegs[6]>>4)&0x01)*10 + (clockRegs[6]&0x0f);
     switch(b){
         case 12: u+=30;
         case 11: u+=31;
@@ -135,43 +150,396 @@ void getTimestamp(void)
     if(!(y%4) && b>2) u++;
 
     //day
-    b = ((time[5]>>4)&0x03)*10 + (time[5]&0x0f) - 1;
+    b = ((clockRegs[5]>>4)&0x03)*10 + (clockRegs[5]&0x0f) - 1;
     u += b;
 
     //hour
     u *= 24;
-    b = ((time[3]>>4)&0x03)*10 + (time[3]&0x0f);
+    b = ((clockRegs[3]>>4)&0x03)*10 + (clockRegs[3]&0x0f);
     u += b;
 
     //minute
     u *= 60;
-    b = ((time[2]>>4)&0x07)*10 + (time[2]&0x0f);
+    b = ((clockRegs[2]>>4)&0x07)*10 + (clockRegs[2]&0x0f);
     u += b;
 
     //second
     u *= 60;
-    b = ((time[1]>>4)&0x07)*10 + (time[1]&0x0f);
+    b = ((clockRegs[1]>>4)&0x07)*10 + (clockRegs[1]&0x0f);
     u += b;
 
-    //30 second intervals
-    u /= 30;
+    return u;
+}
+
+//Running TOTP clock. Timer1 ticks every 128*129 cycles and the ISR adds the
+//tick length to a cycle count, so whole seconds fall out without a divide.
+//timeStep counts clockPeriod second steps, the period of the active slot.
+//The step counter is resynchronised from the RTC every CLOCK_SYNC_SECONDS to
+//take out the error of the calibrated RC oscillator. The tiny85 has no free
+//pin for the DS1307 square wave output.
+#define CLOCK_TICK_CYCLES (128ul * 129ul)
+#define CLOCK_SYNC_SECONDS 60
+
+volatile uint32_t timeStep;
+volatile uint8_t stepSeconds;
+volatile uint8_t clockPeriod = 30;
+volatile uint8_t syncCountdown;
+volatile uint8_t clockDue;
+uint32_t tickCycles;
+
+ISR(TIMER1_COMPA_vect, ISR_NOBLOCK)
+{
+    if(typeWait) typeWait--;
+
+    tickCycles += CLOCK_TICK_CYCLES;
+    if(tickCycles < F_CPU) return;
+    tickCycles -= F_CPU;
+
+    if(++stepSeconds >= clockPeriod)
+    {
+        stepSeconds = 0;
+        timeStep++;
+    }
+    if(syncCountdown) syncCountdown--;
+    clockDue = 1;
+}
+
+void initClock(void)
+{
+    OCR1C = 128;
+    OCR1A = 128;
+    TCCR1 = (1<<CTC1) | (1<<CS13); //CK/128, clear on OCR1C
+    TIMSK |= 1<<OCIE1A;
+}
+
+void syncClock(void)
+{
+    uint8_t period = clockPeriod;
+    uint32_t u = clockSeconds();
+    uint32_t step = u / period;
+    uint8_t seconds = u - step * period;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        timeStep = step;
+        stepSeconds = seconds;
+        tickCycles = 0;
+        syncCountdown = CLOCK_SYNC_SECONDS;
+    }
+}
+
+uint32_t currentStep(void)
+{
+    uint32_t u;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        u = timeStep;
+    }
+    return u;
+}
+
+void setCounter(uint8_t counter[8], uint32_t u)
+{
     for(uint8_t i=0; i<4; i++)
     {
-        time[i] = 0;
-        time[i+4] = (uint8_t)((u >> (24 - i*8)) & 0x000000ff);
+        counter[i] = 0;
+        counter[i+4] = (uint8_t)((u >> (24 - i*8)) & 0x000000ff);
     }
 }
 
+//The counter for otp() comes straight from the running clock, no RTC access
+uint32_t pressStep;
+
+void getTimestamp(void)
+{
+    pressStep = currentStep();
+    setCounter(time, pressStep);
+}
+
+//RTC transfers run in the background on the interrupt driven TWI master and
+//pollClock() moves them along from the main loop
+#define RTC_IDLE 0
+#define RTC_READ 1
+#define RTC_WRITE 2
+uint8_t rtcState = RTC_IDLE;
+
+//Register pointer write and register read in one transaction with a repeated START
+void getClockTime(void)
+{
+    rtc[0] = (0x68<<TWI_ADR_BITS) | (FALSE<<TWI_READ_BIT);
+    rtc[1] = 0;
+    USI_TWI_Start_Combined_Async( rtc, 2, 8 );
+    rtcState = RTC_READ;
+}
+
+void setTime(void)
+{
+    rtc[0] = (0x68<<TWI_ADR_BITS) | (FALSE<<TWI_READ_BIT);
+    rtc[1] = 0;
+    for(uint8_t i=1; i<9; i++) rtc[i+1] = newTime[i];
+    USI_TWI_Start_Async( rtc, 10 );
+    rtcState = RTC_WRITE;
+}
+
+//The registers are read every second so GET_REPORT 2 can answer at once, the
+//step counter is only resynchronised when syncCountdown has run out
+void pollClock(void)
+{
+    if(USI_TWI_Async_State() == USI_TWI_ASYNC_BUSY) return;
+
+    switch(rtcState)
+    {
+        case RTC_READ:
+            if(USI_TWI_Async_State() == USI_TWI_ASYNC_DONE)
+            {
+                for(uint8_t i=1; i<9; i++) clockRegs[i] = rtc[i+1];
+                if(syncCountdown == 0) syncClock();
+            }
+            break;
+        case RTC_WRITE:
+            syncCountdown = 0;
+            getClockTime();
+            return;
+    }
+    rtcState = RTC_IDLE;
+
+    if(state == SET_TIME)
+    {
+        setTime();
+        state = WAIT;
+    }
+    else if(clockDue)
+    {
+        clockDue = 0;
+        getClockTime();
+    }
+}
+
+//Blocking RTC read for startup, needs interrupts enabled
+void readClock(void)
+{
+    getClockTime();
+    while(rtcState != RTC_IDLE) pollClock();
+}
+
+//EEPROM holds SLOT_COUNT slots of 64 bytes followed by the active slot number.
+//A slot keeps only the HMAC midstate of its secret, never the key itself. The
+//midstate comes first so slot 0 matches the old single secret layout, and
+//erased digits and period bytes read as the defaults of 6 and 30.
+#define SLOT_COUNT 7
+#define LABEL_LENGTH 16
+
+struct SlotKey
+{
+    HMAC_SHA1_Midstate key;
+    uint8_t digits;
+    uint8_t period;
+};
+
+struct Slot
+{
+    SlotKey code;
+    char label[LABEL_LENGTH];
+    uint8_t reserved[6];
+};
+
+#define EE_SLOTS ((Slot*)0)
+#define EE_ACTIVE_SLOT ((uint8_t*)(SLOT_COUNT * sizeof(Slot)))
+#define EE_TYPING ((TypingConfig*)(SLOT_COUNT * sizeof(Slot) + 1))
+
+//Codes for step codeStep and the one after, worked out by precompute() while
+//the device is idle. Bit 0 and 1 of codeReady mark the valid ones. codeJob is
+//the only hash state in the firmware, codeBusy is 1 + the code it is working on.
+//CODE_ROUNDS bounds the SHA1 rounds run per pass of the main loop.
+#define CODE_ROUNDS 16
+uint8_t codes[2][8];
+uint32_t codeStep;
+uint8_t codeReady;
+OTP codeJob;
+uint8_t codeBusy;
+
+//The active slot is loaded into RAM at startup and whenever it changes, so a
+//press does no EEPROM access. keyCrc catches the copy being overwritten, by a
+//stack overrun for instance, and forces a reload.
+SlotKey slotKey;
+uint16_t keyCrc;
+uint8_t activeSlot;
+
+uint16_t keyChecksum(void)
+{
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(&slotKey);
+    uint16_t crc = 0xffff;
+    for(uint8_t i=0; i<sizeof(slotKey); i++) crc = _crc16_update(crc, p[i]);
+    return crc;
+}
+
+//Reads the active slot and sets the clock period, syncClock() has to follow
+void loadKey(void)
+{
+    activeSlot = eeprom_read_byte(EE_ACTIVE_SLOT);
+    if(activeSlot >= SLOT_COUNT) activeSlot = 0;
+
+    eeprom_read_block(&slotKey, &EE_SLOTS[activeSlot].code, sizeof(slotKey));
+    if(slotKey.digits < 6 || slotKey.digits > 8) slotKey.digits = 6;
+    if(slotKey.period == 0 || slotKey.period == 0xff) slotKey.period = 30;
+    keyCrc = keyChecksum();
+    clockPeriod = slotKey.period;
+    codeReady = 0;
+    codeBusy = 0;
+}
+
+//Report 3 is the length and key for the active slot with 6 digits and 30
+//seconds. Report 4 is slot, digits, period, label, then length and key.
+//The midstate is worked out in slotKey with codeJob's hash state, as the stack
+//has no room for a SlotKey and an HMAC_SHA1 on top of the SHA1 frames.
+//loadKey() then puts the active slot back.
+void setSecret(void)
+{
+    uint8_t slot = activeSlot;
+    uint8_t* k = &secret[1];
+    slotKey.digits = 6;
+    slotKey.period = 30;
+    if(secret[0] == 4)
+    {
+        slot = secret[1];
+        slotKey.digits = secret[2];
+        slotKey.period = secret[3];
+        k = &secret[20];
+    }
+
+    if(slot < SLOT_COUNT)
+    {
+        if(k[0] > 40) k[0] = 40;
+        codeJob.keyMidstate(&k[1], k[0], slotKey.key);
+        eeprom_update_block(&slotKey, &EE_SLOTS[slot].code, sizeof(slotKey));
+        if(secret[0] == 4) eeprom_update_block(&secret[4], EE_SLOTS[slot].label, LABEL_LENGTH);
+    }
+    for(uint8_t i=0; i<sizeof(secret); i++) secret[i] = 0;
+
+    loadKey();
+    syncClock();
+}
+
+void selectSlot(void)
+{
+    if(secret[1] < SLOT_COUNT && secret[1] != activeSlot)
+    {
+        eeprom_update_byte(EE_ACTIVE_SLOT, secret[1]);
+        loadKey();
+        syncClock();
+    }
+}
+
+//GET_REPORT 5: active slot, slot count, then its digits, period and label
+uint8_t slotInfo(void)
+{
+    secret[0] = 5;
+    secret[1] = activeSlot;
+    secret[2] = SLOT_COUNT;
+    secret[3] = slotKey.digits;
+    secret[4] = slotKey.period;
+    eeprom_read_block(&secret[5], EE_SLOTS[activeSlot].label, LABEL_LENGTH);
+    return 5 + LABEL_LENGTH;
+}
+
+//Erased bytes read as the defaults. Low speed endpoints can't be polled
+//faster than every 10 ms.
+void loadTyping(void)
+{
+    eeprom_read_block(&typing, EE_TYPING, sizeof(typing));
+    if(typing.interval < 10 || typing.interval == 0xff) typing.interval = USB_CFG_INTR_POLL_INTERVAL;
+    if(typing.interval > TYPING_HOLD_MS) typing.interval = TYPING_HOLD_MS;
+    if(typing.gap == 0xff) typing.gap = 0;
+    if(typing.flags == 0xff) typing.flags = TYPE_ENTER ? TYPING_ENTER : 0;
+    //Up to six keys are held, the first for six reports
+    if(6 * (typing.interval + typing.gap) > TYPING_HOLD_MS) typing.flags |= TYPING_RELEASE;
+}
+
+//GET_REPORT 6: interval, gap and flags
+uint8_t typingInfo(void)
+{
+    secret[0] = 6;
+    secret[1] = typing.interval;
+    secret[2] = typing.gap;
+    secret[3] = typing.flags;
+    return 4;
+}
+
+//Drops off the bus for half a second so the host enumerates the device again
+void reconnect(void)
+{
+    usbDeviceDisconnect();
+    for(int i = 0; i<250; i++) {
+            wdt_reset();
+            _delay_ms(2);
+    }
+    usbDeviceConnect();
+}
+
 void getPassword(void)
 {
-    eeprom_read_block(&secret[1], (uint8_t*)0, 1);
-    if(secret[1] > 40) secret[1] = 40;
-    eeprom_read_block(&secret[2], (uint8_t*)0+1, secret[1]);
+    if(keyChecksum() != keyCrc)
+    {
+        loadKey();
+        syncClock();
+        getTimestamp();
+    }
 
-    otp(password, &secret[2], secret[1], time);
+    SIM_MARK(SIM_MARK_OTP);
+    uint8_t* code = 0;
+    if(pressStep == codeStep && (codeReady & 1)) code = codes[0];
+    if(pressStep == codeStep + 1 && (codeReady & 2)) code = codes[1];
+    if(code)
+    {
+        for(uint8_t i=0; i<8; i++) password[i] = code[i];
+    }
+    else
+    {
+        //Whole compressions, the press is waiting
+        codeBusy = 0;
+        codeJob.begin(slotKey.key, time);
+        while(!codeJob.step(slotKey.key, password, slotKey.digits, 80));
+    }
 
 }
 
+//Runs CODE_ROUNDS rounds of a missing code per call, so the main loop keeps
+//polling USB while hashing. When the step moves on the next code becomes the
+//current one and only the new next code is computed.
+void precompute(void)
+{
+    uint32_t step = currentStep();
+    if(step != codeStep)
+    {
+        if(step == codeStep + 1 && (codeReady & 2))
+        {
+            for(uint8_t i=0; i<8; i++) codes[0][i] = codes[1][i];
+            codeReady = 1;
+        }
+        else codeReady = 0;
+        codeStep = step;
+        codeBusy = 0;
+    }
+
+    if(codeReady == 3) return;
+
+    if(!codeBusy)
+    {
+        if(keyChecksum() != keyCrc) return;
+        uint8_t next = codeReady & 1;
+        uint8_t counter[8];
+        setCounter(counter, step + next);
+        codeJob.begin(slotKey.key, counter);
+        codeBusy = next + 1;
+    }
+
+    if(codeJob.step(slotKey.key, codes[codeBusy - 1], slotKey.digits, CODE_ROUNDS))
+    {
+        codeReady |= 1 << (codeBusy - 1);
+        codeBusy = 0;
+    }
+}
+
 PROGMEM const char usbHidReportDescriptor [USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH] = {
     '\x05', '\x01',                    // USAGE_PAGE (Generic Desktop)
     '\x09', '\x06',                    // USAGE (Keyboard)
@@ -185,9 +553,6 @@ PROGMEM const char usbHidReportDescriptor [USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH]
     '\x15', '\x00',                    //   LOGICAL_MINIMUM (0)
     '\x25', '\x01',                    //   LOGICAL_MAXIMUM (1)
     '\x81', '\x02',                    //   INPUT (Data,Var,Abs) ; Modifier byte
-    '\x95', '\x01',                    //   REPORT_COUNT (1)
-    '\x75', '\x08',                    //   REPORT_SIZE (8)
-    '\x81', '\x03',                    //   INPUT (Cnst,Var,Abs) ; Reserved byte
     '\x95', '\x05',                    //   REPORT_COUNT (5)
     '\x75', '\x01',                    //   REPORT_SIZE (1)
     '\x05', '\x08',                    //   USAGE_PAGE (LEDs)
@@ -220,10 +585,48 @@ PROGMEM const char usbHidReportDescriptor [USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH]
     '\x95', '\x29',                    //   REPORT_COUNT (41)
     '\x09', '\x00',                    //   USAGE (Undefined)
     '\xb2', '\x02', '\x01',            //   FEATURE (Data,Var,Abs,Buf)
+    '\x85', '\x04',                    //   REPORT_ID (4)
+    '\x95', '\x3c',                    //   REPORT_COUNT (60)
+    '\x09', '\x00',                    //   USAGE (Undefined)
+    '\xb2', '\x02', '\x01',            //   FEATURE (Data,Var,Abs,Buf)
+    '\x85', '\x05',                    //   REPORT_ID (5)
+    '\x95', '\x14',                    //   REPORT_COUNT (20)
+    '\x09', '\x00',                    //   USAGE (Undefined)
+    '\xb2', '\x02', '\x01',            //   FEATURE (Data,Var,Abs,Buf)
+    '\x85', '\x06',                    //   REPORT_ID (6)
+    '\x95', '\x03',                    //   REPORT_COUNT (3)
+    '\x09', '\x00',                    //   USAGE (Undefined)
+    '\xb2', '\x02', '\x01',            //   FEATURE (Data,Var,Abs,Buf)
     '\xc0'                             // END_COLLECTION
 
 };
 
+//Configuration descriptor with its interface, HID and endpoint descriptors,
+//the last byte is the poll interval
+#define CONFIG_DESCRIPTOR_LENGTH 34
+PROGMEM const char configDescriptor[CONFIG_DESCRIPTOR_LENGTH] = {
+    9, USBDESCR_CONFIG, CONFIG_DESCRIPTOR_LENGTH, 0, 1, 1, 0, '\x80', USB_CFG_MAX_BUS_POWER/2,
+    9, USBDESCR_INTERFACE, 0, 0, 1, USB_CFG_INTERFACE_CLASS, USB_CFG_INTERFACE_SUBCLASS, USB_CFG_INTERFACE_PROTOCOL, 0,
+    9, USBDESCR_HID, 0x01, 0x01, 0, 1, 0x22, USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH, 0,
+    7, USBDESCR_ENDPOINT, '\x81', 3, 8, 0, USB_CFG_INTR_POLL_INTERVAL
+};
+
+//The configuration and HID descriptors are built in RAM so the poll interval
+//can come from EEPROM. Control transfers don't overlap, so secret is free.
+extern "C" usbMsgLen_t usbFunctionDescriptor(usbRequest_t *rq)
+{
+    for(uint8_t i=0; i<CONFIG_DESCRIPTOR_LENGTH; i++) secret[i] = pgm_read_byte(&configDescriptor[i]);
+    secret[CONFIG_DESCRIPTOR_LENGTH - 1] = typing.interval;
+
+    if(rq->wValue.bytes[1] == USBDESCR_HID)
+    {
+        usbMsgPtr = reinterpret_cast<usbMsgPtr_t>(&secret[18]);
+        return 9;
+    }
+    usbMsgPtr = reinterpret_cast<usbMsgPtr_t>(secret);
+    return CONFIG_DESCRIPTOR_LENGTH;
+}
+
 extern "C" usbMsgLen_t usbFunctionSetup(uint8_t data[8])
 {
     usbRequest_t *rq = reinterpret_cast<usbRequest_t*>(data);
@@ -236,15 +639,28 @@ extern "C" usbMsgLen_t usbFunctionSetup(uint8_t data[8])
             case USBRQ_HID_GET_REPORT:
                 if(reportId == 2)
                 {
-                    usbMsgPtr = reinterpret_cast<usbMsgPtr_t>(time);
-                    getClockTime();
-                    time[0] = 2;
+                    usbMsgPtr = reinterpret_cast<usbMsgPtr_t>(clockRegs);
                     return 9;
                 }
-                else if(reportId == 3)
+                else if(reportId == 3 || reportId == 4)
+                {
+                    return 0;
+                }
+                else if(pending != WAIT)
                 {
+                    //Reports 5 and 6 are built in secret, which the queued command needs
                     return 0;
                 }
+                else if(reportId == 5)
+                {
+                    usbMsgPtr = reinterpret_cast<usbMsgPtr_t>(secret);
+                    return slotInfo();
+                }
+                else if(reportId == 6)
+                {
+                    usbMsgPtr = reinterpret_cast<usbMsgPtr_t>(secret);
+                    return typingInfo();
+                }
                 else
                 {
                     usbMsgPtr = reinterpret_cast<usbMsgPtr_t>(&report);
@@ -252,7 +668,9 @@ extern "C" usbMsgLen_t usbFunctionSetup(uint8_t data[8])
                     return sizeof(report);
                 }
             case USBRQ_HID_SET_REPORT: 
-                if(reportId == 3)
+                //Refused until the queued command has used secret
+                if(pending != WAIT) return 0;
+                if(reportId >= 3 && reportId <= 6)
                 {
                     writeCount = 0;
                     return USB_NO_MSG;
@@ -280,6 +698,18 @@ extern "C" usbMsgLen_t usbFunctionSetup(uint8_t data[8])
     return 0;
 }
 
+//Hands a finished SET_REPORT to the main loop. While a code is typed the keys
+//are released first and the command runs after that.
+static void command(uint8_t next)
+{
+    if(state == SEND || state == RELEASE)
+    {
+        pending = next;
+        state = RELEASE;
+    }
+    else state = next;
+}
+
 extern "C" usbMsgLen_t usbFunctionWrite(uint8_t * data, uchar len)
 {
     if(state == INIT)
@@ -287,14 +717,15 @@ extern "C" usbMsgLen_t usbFunctionWrite(uint8_t * data, uchar len)
         state = WAIT;
     }
 
-    if(reportId == 3)
+    if(reportId >= 3 && reportId <= 6)
     {
-        if(writeCount+len > 42) len = 42 - writeCount;
+        uint8_t size = reportId == 3 ? 42 : reportId == 4 ? 61 : reportId == 5 ? 21 : 4;
+        if(writeCount+len > size) len = size - writeCount;
         for(uint8_t i=0; i<len; i++) secret[i+writeCount] = data[i];
         writeCount += len;
-        if(writeCount == 42)
+        if(writeCount == size)
         {
-            eeprom_write_block(&secret[1], 0, 41);
+            command(reportId == 6 ? SET_TYPING : reportId == 5 ? SELECT_SLOT : SET_SECRET);
             return 1;
         }
         else return 0;
@@ -302,11 +733,11 @@ extern "C" usbMsgLen_t usbFunctionWrite(uint8_t * data, uchar len)
     else if(reportId == 2)
     {
         if(writeCount+len > 9) len = 9 - writeCount;
-        for(uint8_t i=0; i<len; i++) time[i+1+writeCount] = data[i];
+        for(uint8_t i=0; i<len; i++) newTime[i+writeCount] = data[i];
         writeCount += len;
         if(writeCount == 9)
         {
-            state = SET_TIME;
+            command(SET_TIME);
             return 1;
         }
         else return 0;
@@ -357,35 +788,87 @@ extern "C" void usbEventResetReady(void)
     sei();
 }
 
+#ifdef OTP_SIM
+//Build for the simavr benchmark: one button press without USB, then stop
+int main(void)
+{
+    USI_TWI_Master_Initialise();
+    initClock();
+    sei();
+    loadKey();
+
+    SIM_MARK(SIM_MARK_SYNC);
+    readClock();
+    SIM_MARK(SIM_MARK_TIMESTAMP);
+    getTimestamp();
+    SIM_MARK(SIM_MARK_PASSWORD);
+    getPassword();
+    SIM_MARK(SIM_MARK_DONE);
+
+    for(uint8_t i=0; i<slotKey.digits; i++) SIM_OUTPUT = password[i];
+
+    cli();
+    sleep_enable();
+    sleep_cpu();
+    return 0;
+}
+#else
 int main(void)
 {
     wdt_enable(WDTO_1S);
     DDRB &= ~(1 << PB1);
     PORTB |= 1 << PB1; //pullup input
 
+    loadTyping();
     usbInit();
-    usbDeviceDisconnect();
-    for(int i = 0; i<250; i++) {
-            wdt_reset();
-            _delay_ms(2);
-    }
-    usbDeviceConnect();
+    reconnect();
 
     USI_TWI_Master_Initialise();
+    initClock();
 
     sei();
+    loadKey();
+    readClock();
 
     for ( ;; )
     {
         wdt_reset();
         usbPoll();
 
-        if(state == SET_TIME)
+        pollClock();
+        if(state == WAIT) precompute();
+
+        if(state == SET_SECRET)
         {
-            setTime();
+            setSecret();
             state = WAIT;
         }
 
+        if(state == SELECT_SLOT)
+        {
+            selectSlot();
+            state = WAIT;
+        }
+
+        if(state == SET_TYPING)
+        {
+            uint8_t interval = typing.interval;
+            eeprom_update_block(&secret[1], EE_TYPING, sizeof(typing));
+            loadTyping();
+            state = WAIT;
+            //A new poll interval only takes effect when the host reads the
+            //configuration descriptor again. Finish the SET_REPORT first.
+            if(typing.interval != interval)
+            {
+                for(uint8_t i=0; i<20; i++)
+                {
+                    usbPoll();
+                    _delay_ms(1);
+                }
+                reconnect();
+            }
+        }
+
         if(!(PINB & (1<<PB1)))
         {
             if(state == WAIT && holdCounter == 0)
@@ -400,27 +883,36 @@ int main(void)
 
         if(holdCounter > 0) holdCounter--;
 
-        if(usbInterruptIsReady())
+        if(usbInterruptIsReady() && typeWait == 0)
         {
             switch(state)
             {
                 case SEND:
-                    report[0] = 30 + (password[charIndex]-39)%10;
-                    charIndex++;
-                    state = RELEASE;
+                {
+                    uint8_t key = KEY_ENTER;
+                    if(charIndex < slotKey.digits) key = 30 + (password[charIndex]-39)%10;
+                    if(keyCount == 6 || report.holds(key) || (keyCount && (typing.flags & TYPING_RELEASE)))
+                    {
+                        report.clear();
+                        keyCount = 0;
+                        break;
+                    }
+                    report[keyCount++] = key;
+                    if(++charIndex == slotKey.digits + (typing.flags & TYPING_ENTER)) state = RELEASE;
                     break;
+                }
                 case RELEASE:
-                    report[0] = 0;
-                    if(charIndex<6) state = SEND;
-                    else state = WAIT; 
+                    report.clear();
+                    keyCount = 0;
+                    state = pending;
+                    pending = WAIT;
                     break;
                 default:
                     continue;
             }
 
-            usbSetInterrupt(reinterpret_cast<unsigned char*>(&report), 8);
-            while (!usbInterruptIsReady()) usbPoll();
-            usbSetInterrupt(reinterpret_cast<unsigned char*>(&report) + 8, sizeof(report) - 8);
+            usbSetInterrupt(reinterpret_cast<unsigned char*>(&report), sizeof(report));
+            typeWait = keyCount && (typing.flags & TYPING_RELEASE) ? 0 : typing.gap;
         }
 
     }
@@ -428,3 +920,4 @@ int main(void)
     return 0;
 
 }
+#endif
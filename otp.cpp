@@ -0,0 +1,119 @@
+/*
+
+An implementation of the RFC 6238 time based OTP protocol on an AtTiny85 microcontroller
+
+Copyright (C) 2017 Adam Reid
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#include "otp.h"
+#ifndef __AVR__
+#include "sha1_multi.h"
+#include <string.h>
+#endif
+
+//RFC 4226 dynamic truncation to digits decimal digits
+static void decimalCode(uint8_t digest[20], uint8_t* password, uint8_t digits)
+{
+    uint8_t o = digest[19] & 0x0f;
+    
+    digest[o] &= 0x7f;
+    uint32_t p = 0;
+    for(uint8_t i=0; i<4; i++){
+        uint32_t x = digest[o+i];
+        p |= x << (3-i)*8;
+    } 
+
+    for(uint8_t i=digits; i>0; i--){
+        password[i-1] = (p%10ul) + 48ul;
+        p /= 10ul;
+    }
+}
+
+void otp(uint8_t* password, const HMAC_SHA1_Midstate& key, uint8_t time[8], uint8_t digits)
+{
+    HMAC_SHA1 hmac(key);
+    hmac.update(time, 8);
+
+    uint8_t digest[20];
+    hmac.digest(key, digest);
+    decimalCode(digest, password, digits);
+}
+
+#ifndef __AVR__
+//Both HMAC blocks are built by hand, the inner one is the 8 byte counter after
+//the ipad block and the outer one the 20 byte inner digest after the opad block
+void otpWindow(uint8_t* passwords, const HMAC_SHA1_Midstate& key, uint64_t step, uint8_t count, uint8_t digits, const SHA1_Multi& multi)
+{
+    //Message words by lane. Only the counter, the inner digest and the padding
+    //change, every row is filled across the lanes so the stores vectorise.
+    uint32_t W[16][16];
+    uint32_t state[5][16];
+    memset(W, 0, sizeof(W));
+
+    while(count)
+    {
+        uint8_t n = count < 16 ? count : 16;
+        for(uint8_t i = 0; i < 16; i++)
+        {
+            W[0][i] = (step + i) >> 32;
+            W[1][i] = step + i;
+        }
+        for(uint8_t i = 0; i < 16; i++) W[2][i] = 0x80000000;
+        for(uint8_t j = 3; j < 6; j++) for(uint8_t i = 0; i < 16; i++) W[j][i] = 0;
+        for(uint8_t i = 0; i < 16; i++) W[15][i] = 72 * 8;
+        for(uint8_t j = 0; j < 5; j++) for(uint8_t i = 0; i < 16; i++) state[j][i] = key.inner[j];
+        multi.compressWords(state, W, n);
+
+        memcpy(W, state, sizeof(state));
+        for(uint8_t i = 0; i < 16; i++) W[5][i] = 0x80000000;
+        for(uint8_t i = 0; i < 16; i++) W[15][i] = 84 * 8;
+        for(uint8_t j = 0; j < 5; j++) for(uint8_t i = 0; i < 16; i++) state[j][i] = key.outer[j];
+        multi.compressWords(state, W, n);
+
+        for(uint8_t i = 0; i < n; i++)
+        {
+            uint8_t digest[20];
+            for(uint8_t j = 0; j < 20; j++) digest[j] = state[j >> 2][i] >> 8 * (3 - (j & 3));
+            decimalCode(digest, passwords, digits);
+            passwords += digits;
+        }
+        step += n;
+        count -= n;
+    }
+}
+#endif
+
+void OTP::begin(const HMAC_SHA1_Midstate& key, uint8_t time[8])
+{
+    mHMAC.reset(key);
+    mHMAC.update(time, 8);
+    mHMAC.digestBegin(mResume);
+}
+
+bool OTP::step(const HMAC_SHA1_Midstate& key, uint8_t* password, uint8_t digits, uint8_t rounds)
+{
+    uint8_t digest[20];
+    if(!mHMAC.digestStep(mResume, key, digest, rounds)) return false;
+    decimalCode(digest, password, digits);
+    return true;
+}
+
+void OTP::keyMidstate(const uint8_t* key, uint8_t length, HMAC_SHA1_Midstate& state)
+{
+    mHMAC.keyMidstate(key, length, state);
+}
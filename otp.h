@@ -0,0 +1,73 @@
+/*
+
+An implementation of the RFC 6238 time based OTP protocol on an AtTiny85 microcontroller
+
+Copyright (C) 2017 Adam Reid
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#ifndef _OTP_H_
+#define _OTP_H_
+
+#include <stdint.h>
+#include "hmac_sha1.h"
+
+/*
+RFC 6238 time based OTP. time is the 8 byte big endian count of time steps
+(usually 30 seconds) since the Unix epoch, password receives digits ASCII
+digits, six unless given. Up to nine digits are meaningful.
+
+Shared by the firmware and host builds so both compute codes the same way.
+*/
+
+void otp(uint8_t* password, const HMAC_SHA1_Midstate& key, uint8_t time[8], uint8_t digits = 6);
+
+#ifndef __AVR__
+class SHA1_Multi;
+
+/*
+Host only: the codes of count consecutive steps from step, for checking a
+window of steps. Every step is hashed in its own lane of multi (sha1_multi.h)
+with the same key midstates, the blocks built directly as lane words for
+SHA1_Multi::compressWords(). passwords receives count codes of digits ASCII
+digits each, one after the other.
+*/
+void otpWindow(uint8_t* passwords, const HMAC_SHA1_Midstate& key, uint64_t step, uint8_t count, uint8_t digits, const SHA1_Multi& multi);
+#endif
+
+/*
+Resumable otp() for callers that can't block for a whole code, like the
+firmware main loop which has to keep polling USB. begin() starts a code and
+each step() runs at most rounds SHA1 rounds, returning true once password holds
+the code. A code is two compressions of 80 rounds. key must stay the same
+between begin() and the last step(). keyMidstate() is HMAC_SHA1::midstate() on
+the job's own hash state, so the firmware needs no second one on the stack. It
+ends any code in progress.
+*/
+class OTP
+{
+    public:
+    void begin(const HMAC_SHA1_Midstate& key, uint8_t time[8]);
+    bool step(const HMAC_SHA1_Midstate& key, uint8_t* password, uint8_t digits, uint8_t rounds);
+    void keyMidstate(const uint8_t* key, uint8_t length, HMAC_SHA1_Midstate& state);
+
+    private:
+    HMAC_SHA1 mHMAC;
+    HMAC_SHA1_Resume mResume;
+};
+
+#endif
@@ -0,0 +1,673 @@
+/*
+
+An implementation of the RFC 6238 time based OTP protocol on an AtTiny85 microcontroller
+
+Copyright (C) 2017 Adam Reid
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+/*
+Host conformance tests for the code shared with the firmware: the RFC 3174
+SHA1 vectors (for both SHA1 layouts and the multi-buffer engines), the RFC 2202
+HMAC-SHA1 vectors (key and midstate forms) and the RFC 6238 TOTP table for
+otp(), its resumable form and otpWindow() on every multi-buffer engine, then
+checks OTP_Verifier and its thread pool
+against the same table, from memory and from an OTP_SecretDB file, and the
+OTP_ReplayCache and OTP_DriftTable on their own and behind the verifier. Also prints the time per operation so optimisations can be checked for
+speed alongside correctness.
+
+Build and run with: make check
+*/
+
+#include "otp.h"
+#include "sha1_multi.h"
+#include "verifier.h"
+#include <atomic>
+#include <chrono>
+#include <fcntl.h>
+#include <glob.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+static int failures = 0;
+
+static void check(bool ok, const char* what)
+{
+    if(!ok)
+    {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static bool matches(const uint8_t* hash, const char* hex)
+{
+    char out[41];
+    for(uint8_t i = 0; i < 20; i++) sprintf(out + 2 * i, "%02x", hash[i]);
+    return !strcmp(out, hex);
+}
+
+struct HashVector
+{
+    const char* message;
+    unsigned long repeat;
+    const char* digest;
+};
+
+//RFC 3174 section 7.3
+static const HashVector sha1Vectors[] = {
+    {"abc", 1, "a9993e364706816aba3e25717850c26c9cd0d89d"},
+    {"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1, "84983e441c3bd26ebaae4aa1f95129e5e54670f1"},
+    {"a", 1000000, "34aa973cd4c4daa4f61eeb2bdbad27316534016f"},
+    {"01234567012345670123456701234567", 20, "dea356a2cddd90c7a7ecedc5ebb563934f460452"},
+};
+
+template<class Traits> static void testSHA1(const char* name)
+{
+    for(const HashVector& v : sha1Vectors)
+    {
+        uint8_t length = strlen(v.message);
+        //The compact layout counts message bits in its Count type
+        if((uint64_t)length * v.repeat * 8 > (typename Traits::Count)~0) continue;
+
+        SHA1Core<Traits> sha1;
+        for(unsigned long i = 0; i < v.repeat; i++) sha1.update((const uint8_t*)v.message, length);
+        uint8_t hash[20];
+        sha1.digest(hash);
+        char what[80];
+        snprintf(what, sizeof(what), "%s SHA1 of \"%.16s\" x %lu", name, v.message, v.repeat);
+        check(matches(hash, v.digest), what);
+    }
+}
+
+//Compresses the one block message "abc" in every lane
+static void testMulti()
+{
+    uint8_t block[64] = {'a', 'b', 'c', 0x80};
+    block[63] = 24;
+    uint32_t state[37][5];
+    const uint8_t* blocks[37];
+    for(uint8_t i = 0; i < 37; i++)
+    {
+        SHA1 sha1;
+        sha1.midstate(state[i]);
+        blocks[i] = block;
+    }
+
+    for(uint8_t lanes = 4; lanes <= 16; lanes *= 2)
+    {
+        SHA1_Multi multi(lanes);
+        if(multi.lanes() != lanes) continue;
+        uint32_t s[37][5];
+        memcpy(s, state, sizeof(s));
+        multi.compress(s, blocks, 37);
+        bool ok = true;
+        for(uint8_t i = 0; i < 37; i++)
+        {
+            uint8_t hash[20];
+            for(uint8_t j = 0; j < 20; j++) hash[j] = s[i][j >> 2] >> 8 * (3 - (j & 3));
+            ok &= matches(hash, sha1Vectors[0].digest);
+        }
+        char what[40];
+        snprintf(what, sizeof(what), "SHA1_Multi %s", multi.name());
+        check(ok, what);
+
+        //The same block as lane words, one lane short of a full group
+        uint32_t words[5][16];
+        uint32_t W[16][16];
+        for(uint8_t i = 0; i < 16; i++)
+        {
+            for(uint8_t j = 0; j < 5; j++) words[j][i] = state[i][j];
+            for(uint8_t t = 0; t < 16; t++) W[t][i] = (uint32_t)block[4 * t] << 24 | block[4 * t + 1] << 16 | block[4 * t + 2] << 8 | block[4 * t + 3];
+        }
+        multi.compressWords(words, W, 15);
+        ok = true;
+        for(uint8_t i = 0; i < 15; i++)
+        {
+            uint8_t hash[20];
+            for(uint8_t j = 0; j < 20; j++) hash[j] = words[j >> 2][i] >> 8 * (3 - (j & 3));
+            ok &= matches(hash, sha1Vectors[0].digest);
+        }
+        snprintf(what, sizeof(what), "SHA1_Multi %s compressWords", multi.name());
+        check(ok, what);
+    }
+}
+
+struct HMACVector
+{
+    uint8_t key[80];
+    uint8_t keyLength;
+    const char* data;
+    uint8_t dataLength;
+    const char* digest;
+};
+
+//RFC 2202 section 3, cases 6 and 7 hash their 80 byte key first as HMAC requires
+static const HMACVector hmacVectors[] = {
+    {{0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b},
+     20, "Hi There", 8, "b617318655057264e28bc0b6fb378c8ef146be00"},
+    {{'J', 'e', 'f', 'e'}, 4, "what do ya want for nothing?", 28, "effcdf6ae5eb2fa2d27416d5f184df9c259a7c79"},
+    {{0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa},
+     20, "\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd"
+         "\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd\xdd",
+     50, "125d7342b9ac11cd91a39af48aa17b4f63f175d3"},
+    {{0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12, 0x13,
+      0x14, 0x15, 0x16, 0x17, 0x18, 0x19},
+     25, "\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd"
+         "\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd\xcd",
+     50, "4c9007f4026250c6bc8414f9bf50c86c2d7235da"},
+    {{0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c},
+     20, "Test With Truncation", 20, "4c1a03424b55e07fe7f27be1d58bb9324a9a5a04"},
+    {{0}, 80, "Test Using Larger Than Block-Size Key - Hash Key First", 54, "aa4ae5e15272d00e95705637ce8a3b55ed402112"},
+    {{0}, 80, "Test Using Larger Than Block-Size Key and Larger Than One Block-Size Data", 73,
+     "e8e99d0f45237d786d6bbaa7965c7808bbff1a91"},
+};
+
+static void testHMAC()
+{
+    int n = 1;
+    for(const HMACVector& v : hmacVectors)
+    {
+        uint8_t key[80];
+        uint8_t keyLength = v.keyLength;
+        memcpy(key, v.key, keyLength);
+        if(keyLength > 64)
+        {
+            memset(key, 0xaa, keyLength);
+            SHA1 sha1;
+            sha1.update(key, keyLength);
+            sha1.digest(key);
+            keyLength = 20;
+        }
+
+        uint8_t hash[20];
+        HMAC_SHA1 hmac(key, keyLength);
+        hmac.update((const uint8_t*)v.data, v.dataLength);
+        hmac.digest(key, keyLength, hash);
+        char what[40];
+        snprintf(what, sizeof(what), "RFC 2202 case %d", n);
+        check(matches(hash, v.digest), what);
+
+        HMAC_SHA1_Midstate mid;
+        HMAC_SHA1::midstate(key, keyLength, mid);
+        HMAC_SHA1 resumed(mid);
+        resumed.update((const uint8_t*)v.data, v.dataLength);
+        resumed.digest(mid, hash);
+        snprintf(what, sizeof(what), "RFC 2202 case %d from midstate", n);
+        check(matches(hash, v.digest), what);
+        n++;
+    }
+}
+
+static void counterBytes(uint64_t step, uint8_t counter[8])
+{
+    for(uint8_t i = 0; i < 8; i++) counter[i] = step >> (56 - 8 * i);
+}
+
+//RFC 6238 appendix B, SHA1 rows. The table has eight digits, six digit codes
+//are the last six
+static const struct
+{
+    uint64_t time;
+    const char* code;
+} totpVectors[] = {
+    {59, "94287082"},
+    {1111111109, "07081804"},
+    {1111111111, "14050471"},
+    {1234567890, "89005924"},
+    {2000000000, "69279037"},
+    {20000000000ull, "65353130"},
+};
+
+static void testTOTP()
+{
+    HMAC_SHA1_Midstate key;
+    HMAC_SHA1::midstate((const uint8_t*)"12345678901234567890", 20, key);
+    for(const auto& v : totpVectors)
+    {
+        uint8_t counter[8];
+        counterBytes(v.time / 30, counter);
+        uint8_t password[9] = {0};
+        otp(password, key, counter);
+        char what[40];
+        snprintf(what, sizeof(what), "RFC 6238 T=%llu", (unsigned long long)v.time);
+        check(!strcmp((const char*)password, v.code + 2), what);
+        otp(password, key, counter, 8);
+        snprintf(what, sizeof(what), "RFC 6238 T=%llu 8 digits", (unsigned long long)v.time);
+        check(!strcmp((const char*)password, v.code), what);
+    }
+}
+
+//Slices of every size that splits the 80 rounds differently, and whole blocks
+static const uint8_t stepSizes[] = {1, 7, 16, 20, 79, 80, 255};
+
+//Stepped digests must match digest(), including messages that need a second
+//padding block
+template<class Traits> static void testSHA1Steps(const char* name)
+{
+    uint8_t message[64];
+    for(uint8_t i = 0; i < 64; i++) message[i] = i * 7;
+    for(uint8_t length = 0; length <= 64; length += 4)
+    {
+        SHA1Core<Traits> whole;
+        whole.update(message, length);
+        uint8_t expected[20];
+        whole.digest(expected);
+
+        for(uint8_t rounds : stepSizes)
+        {
+            SHA1Core<Traits> sha1;
+            sha1.update(message, length);
+            SHA1Resume r;
+            sha1.digestBegin(r);
+            uint8_t hash[20];
+            while(!sha1.digestStep(r, hash, rounds));
+            char what[80];
+            snprintf(what, sizeof(what), "%s SHA1 of %u bytes in %u round steps", name, length, rounds);
+            check(!memcmp(hash, expected, 20), what);
+        }
+    }
+}
+
+static void testTOTPSteps()
+{
+    HMAC_SHA1_Midstate key;
+    HMAC_SHA1::midstate((const uint8_t*)"12345678901234567890", 20, key);
+    for(const auto& v : totpVectors)
+    {
+        uint8_t counter[8];
+        counterBytes(v.time / 30, counter);
+        for(uint8_t rounds : stepSizes)
+        {
+            OTP job;
+            job.begin(key, counter);
+            uint8_t password[9] = {0};
+            while(!job.step(key, password, 8, rounds));
+            char what[48];
+            snprintf(what, sizeof(what), "RFC 6238 T=%llu in %u round steps", (unsigned long long)v.time, rounds);
+            check(!strcmp((const char*)password, v.code), what);
+        }
+    }
+
+    //The firmware works out a new secret's midstate with its code job, halfway
+    //through a code
+    OTP job;
+    uint8_t counter[8];
+    uint8_t password[9] = {0};
+    counterBytes(totpVectors[0].time / 30, counter);
+    job.begin(key, counter);
+    job.step(key, password, 8, 100);
+    HMAC_SHA1_Midstate again;
+    job.keyMidstate((const uint8_t*)"12345678901234567890", 20, again);
+    check(!memcmp(&again, &key, sizeof(key)), "OTP::keyMidstate in the middle of a code");
+    job.begin(again, counter);
+    while(!job.step(again, password, 8, 80));
+    check(!strcmp((const char*)password, totpVectors[0].code), "OTP after keyMidstate");
+}
+
+static void testVerifier(const OTP_KeySource& keys)
+{
+    OTP_Verifier verifier(keys, 1);
+    OTP_Verifier exact(keys, 0);
+
+    for(const auto& v : totpVectors)
+    {
+        char what[48];
+        snprintf(what, sizeof(what), "verify T=%llu", (unsigned long long)v.time);
+        check(verifier.verify(7, v.code, v.time) == OTP_VERIFY_OK, what);
+        snprintf(what, sizeof(what), "verify T=%llu a step late", (unsigned long long)v.time);
+        check(verifier.verify(7, v.code, v.time + 30) == OTP_VERIFY_OK, what);
+        check(exact.verify(7, v.code, v.time + 30) == OTP_VERIFY_BAD_CODE, what);
+        snprintf(what, sizeof(what), "verify T=%llu two steps late", (unsigned long long)v.time);
+        check(verifier.verify(7, v.code, v.time + 60) == OTP_VERIFY_BAD_CODE, what);
+        snprintf(what, sizeof(what), "verify T=%llu 6 digits", (unsigned long long)v.time);
+        check(verifier.verify(7, v.code + 2, v.time) == OTP_VERIFY_BAD_CODE, what);
+    }
+    check(verifier.verify(8, totpVectors[0].code, totpVectors[0].time) == OTP_VERIFY_UNKNOWN_USER, "verify unknown user");
+
+    //Every request twice, once with a wrong digit
+    const size_t count = 2 * sizeof(totpVectors) / sizeof(totpVectors[0]);
+    OTP_VerifyRequest requests[count];
+    OTP_VerifyResult results[count];
+    for(size_t i = 0; i < count; i++)
+    {
+        requests[i].user = 7;
+        requests[i].time = totpVectors[i / 2].time;
+        strcpy(requests[i].code, totpVectors[i / 2].code);
+        if(i & 1) requests[i].code[3] = requests[i].code[3] == '0' ? '1' : '0';
+    }
+    std::atomic<int> batches(0);
+    {
+        OTP_VerifierPool pool(verifier, 2);
+        for(size_t i = 0; i < count; i += 2) pool.submit(&requests[i], &results[i], 2, [&]{ batches++; });
+    }
+    bool ok = batches == count / 2;
+    for(size_t i = 0; i < count; i++) ok &= results[i] == (i & 1 ? OTP_VERIFY_BAD_CODE : OTP_VERIFY_OK);
+    check(ok, "OTP_VerifierPool");
+}
+
+//User 7 has the RFC 6238 key with 8 digits, the others make the table collide
+static bool patch(const char* path, const void* data, size_t size, off_t offset)
+{
+    int fd = open(path, O_WRONLY);
+    if(fd < 0) return false;
+    bool ok = pwrite(fd, data, size, offset) == (ssize_t)size;
+    return !close(fd) && ok;
+}
+
+static void testSecretDB()
+{
+    OTP_SecretStore store;
+    store.add(7, (const uint8_t*)"12345678901234567890", 20, 8);
+    check(!store.add(8, (const uint8_t*)"12345678901234567890", 20, 5), "store rejects 5 digits");
+    check(!store.add(8, (const uint8_t*)"12345678901234567890", 20, 9), "store rejects 9 digits, more than a token types");
+    check(!store.add(8, (const uint8_t*)"12345678901234567890123456789012345678901", 41, 6), "store rejects keys a token can't hold");
+    for(uint64_t user = 100; user < 1100; user++) store.add(user, (const uint8_t*)&user, sizeof(user));
+    testVerifier(store);
+
+    char path[] = "/tmp/otp-test-XXXXXX";
+    int fd = mkstemp(path);
+    if(fd < 0)
+    {
+        check(false, "temporary file for OTP_SecretDB");
+        return;
+    }
+    close(fd);
+    check(OTP_SecretDB::write(path, store), "OTP_SecretDB::write");
+    OTP_SecretDB db;
+    check(db.open(path) && db.size() == store.size(), "OTP_SecretDB::open");
+    testVerifier(db);
+    bool same = true;
+    for(uint64_t user = 100; user < 1100; user++)
+    {
+        const OTP_Key* k = db.find(user);
+        same &= k && !memcmp(k, store.find(user), sizeof(OTP_Key));
+    }
+    check(same, "OTP_SecretDB keys match the store");
+
+    //Rewriting the file leaves the open map alone
+    OTP_SecretStore other;
+    other.add(5, (const uint8_t*)"12345678901234567890", 20);
+    check(OTP_SecretDB::write(path, other), "OTP_SecretDB::write over an open file");
+    check(db.find(7) && !db.find(5), "OTP_SecretDB keeps the old file after a rewrite");
+    OTP_SecretDB rewritten;
+    check(rewritten.open(path) && rewritten.find(5) && !rewritten.find(7), "OTP_SecretDB opens the rewritten file");
+
+    //Concurrent writers each get their own temporary file, one of them wins and
+    //none is left behind
+    OTP_SecretStore racing[4];
+    std::thread writers[4];
+    std::atomic<int> written(0);
+    for(int i = 0; i < 4; i++)
+    {
+        racing[i].add(200 + i, (const uint8_t*)"12345678901234567890", 20);
+        writers[i] = std::thread([&, i]{ for(int n = 0; n < 20; n++) written += OTP_SecretDB::write(path, racing[i]); });
+    }
+    for(std::thread& t : writers) t.join();
+    OTP_SecretDB raced;
+    bool one = raced.open(path) && raced.size() == 1;
+    int found = 0;
+    for(int i = 0; i < 4; i++) found += raced.find(200 + i) != 0;
+    glob_t left;
+    std::string pattern = std::string(path) + ".*";
+    bool clean = glob(pattern.c_str(), 0, 0, &left) == GLOB_NOMATCH;
+    if(!clean) globfree(&left);
+    struct stat st;
+    check(written == 80 && one && found == 1 && clean, "OTP_SecretDB::write from concurrent writers");
+    check(!stat(path, &st) && (st.st_mode & 0777) == 0600, "OTP_SecretDB files are only readable by their owner");
+
+    //A table with no empty record, but a count that passes the header check,
+    //ends a lookup for a missing user after one pass. The file has two slots.
+    OTP_Record full[2];
+    memset(full, 0, sizeof(full));
+    for(uint8_t i = 0; i < 2; i++)
+    {
+        full[i].user = 98 + i;
+        full[i].key.digits = 6;
+        full[i].key.period = 30;
+    }
+    check(patch(path, full, sizeof(full), sizeof(OTP_DBHeader)), "fill the table");
+    OTP_SecretDB damaged;
+    check(damaged.open(path) && !damaged.find(1) && damaged.find(99), "OTP_SecretDB lookups end in a full table");
+
+    //A count over half the slots is refused
+    uint64_t count = 2;
+    check(patch(path, &count, sizeof(count), offsetof(OTP_DBHeader, count)), "write the count");
+    OTP_SecretDB crowded;
+    check(!crowded.open(path), "OTP_SecretDB refuses a table over half full");
+
+    //A truncated file is refused
+    if(truncate(path, 4096)) check(false, "truncate");
+    OTP_SecretDB bad;
+    check(!bad.open(path), "OTP_SecretDB refuses a truncated file");
+
+    //A record add() would not make isn't found, rather than reaching the
+    //verifier's division by the period or its digit buffers
+    check(OTP_SecretDB::write(path, store), "OTP_SecretDB::write for the record checks");
+    off_t at = 0;
+    fd = open(path, O_RDONLY);
+    OTP_Record r;
+    for(off_t o = sizeof(OTP_DBHeader); fd >= 0 && pread(fd, &r, sizeof(r), o) == sizeof(r); o += sizeof(r))
+    {
+        if(r.user == 7 && r.key.digits) at = o;
+    }
+    if(fd >= 0) close(fd);
+    check(at != 0, "find user 7 in the file");
+    const uint8_t badRecords[][2] = {{8, 0}, {10, 30}, {255, 30}, {5, 30}};
+    bool refused = true;
+    for(const auto& b : badRecords)
+    {
+        refused &= patch(path, b, 2, at + offsetof(OTP_Record, key) + offsetof(OTP_Key, digits));
+        OTP_SecretDB patched;
+        refused &= patched.open(path) && !patched.find(7) && patched.find(100);
+        OTP_Verifier verifier(patched, 2);
+        const char* code = "1234567890";
+        refused &= verifier.verify(7, code + (b[0] < 10 ? 10 - b[0] : 0), 59) == OTP_VERIFY_UNKNOWN_USER;
+    }
+    check(refused, "OTP_SecretDB doesn't return records with bad digits or period");
+    unlink(path);
+}
+
+static void testReplayCache()
+{
+    //One bucket, so a ninth live code finds no room until the others expire
+    OTP_ReplayCache cache(1);
+    bool ok = true;
+    for(uint64_t user = 0; user < 7; user++) ok &= cache.use(user, 1000, 900);
+    check(ok, "OTP_ReplayCache accepts new codes");
+    check(!cache.use(3, 1000, 900), "OTP_ReplayCache refuses a used code");
+    check(cache.use(3, 1030, 900), "OTP_ReplayCache accepts the next step");
+    check(!cache.use(9, 1000, 900), "OTP_ReplayCache refuses when full");
+    check(cache.use(9, 1100, 1000), "OTP_ReplayCache reuses expired entries");
+
+    OTP_SecretStore store;
+    store.add(7, (const uint8_t*)"12345678901234567890", 20, 8);
+    OTP_ReplayCache used(16);
+    OTP_Verifier verifier(store, 1, &used);
+    const auto& v = totpVectors[3];
+    check(verifier.verify(7, v.code, v.time) == OTP_VERIFY_OK, "verify with replay cache");
+    check(verifier.verify(7, v.code, v.time + 30) == OTP_VERIFY_REPLAY, "verify refuses a replay a step later");
+    check(verifier.verify(7, totpVectors[2].code, totpVectors[2].time) == OTP_VERIFY_OK, "verify another step");
+
+    //Threads racing with the same codes, each accepted at most once
+    OTP_ReplayCache raced(64);
+    std::atomic<int> accepted[200];
+    for(std::atomic<int>& a : accepted) a = 0;
+    std::vector<std::thread> threads;
+    for(int t = 0; t < 4; t++)
+    {
+        threads.push_back(std::thread([&]{
+            for(uint64_t code = 0; code < 200; code++) accepted[code] += raced.use(code % 50, 2000 + code / 50, 1000);
+        }));
+    }
+    for(std::thread& t : threads) t.join();
+    ok = true;
+    for(std::atomic<int>& a : accepted) ok &= a <= 1;
+    check(ok, "OTP_ReplayCache accepts a raced code at most once");
+}
+
+static void testDrift()
+{
+    OTP_DriftTable table(4);
+    check(table.get(1) == 0, "OTP_DriftTable starts with no drift");
+    table.set(1, -2);
+    check(table.get(1) == -2, "OTP_DriftTable keeps a drift");
+    table.set(1, 0);
+    check(table.get(1) == 0, "OTP_DriftTable clears a drift");
+
+    //A token running a step slow is found there, then stays there
+    OTP_SecretStore store;
+    store.add(7, (const uint8_t*)"12345678901234567890", 20, 8);
+    OTP_DriftTable drift(16);
+    OTP_Verifier verifier(store, 2, 0, &drift);
+    bool ok = true;
+    for(const auto& v : totpVectors) ok &= verifier.verify(7, v.code, v.time + 30) == OTP_VERIFY_OK;
+    check(ok && drift.get(7) == -1, "verify records a drift of -1");
+    for(const auto& v : totpVectors) ok &= v.time < 60 || verifier.verify(7, v.code, v.time - 60) == OTP_VERIFY_OK;
+    check(ok && drift.get(7) == 2, "verify follows the drift to +2");
+    check(verifier.verify(7, totpVectors[3].code, totpVectors[3].time + 90) == OTP_VERIFY_BAD_CODE,
+          "verify keeps the window around the server step");
+
+    //A drift recorded with a wider window is ignored outside a narrower one
+    OTP_Verifier narrow(store, 1, 0, &drift);
+    check(narrow.verify(7, totpVectors[3].code, totpVectors[3].time) == OTP_VERIFY_OK, "verify with a drift outside the window");
+    check(drift.get(7) == 0, "verify resets the drift");
+}
+
+//Windows that fill part of a group of lanes, exactly one and more than one
+static void testTOTPWindow()
+{
+    HMAC_SHA1_Midstate key;
+    HMAC_SHA1::midstate((const uint8_t*)"12345678901234567890", 20, key);
+    static const uint8_t counts[] = {1, 3, 5, 16, 37};
+    for(uint8_t lanes = 4; lanes <= 16; lanes *= 2)
+    {
+        SHA1_Multi multi(lanes);
+        if(multi.lanes() != lanes) continue;
+        bool ok = true;
+        for(const auto& v : totpVectors)
+        {
+            for(uint8_t count : counts)
+            {
+                uint64_t first = v.time / 30 > 2 ? v.time / 30 - 2 : 0;
+                uint8_t passwords[37 * 8];
+                otpWindow(passwords, key, first, count, 8, multi);
+                for(uint8_t i = 0; i < count; i++)
+                {
+                    uint8_t counter[8];
+                    counterBytes(first + i, counter);
+                    uint8_t password[8];
+                    otp(password, key, counter, 8);
+                    ok &= !memcmp(password, &passwords[i * 8], 8);
+                }
+                uint64_t at = v.time / 30 - first;
+                ok &= at >= count || !memcmp(&passwords[at * 8], v.code, 8);
+            }
+        }
+        char what[40];
+        snprintf(what, sizeof(what), "otpWindow %s", multi.name());
+        check(ok, what);
+    }
+}
+
+typedef std::chrono::steady_clock Clock;
+
+//Prints the average time of f over at least 0.2 seconds
+template<class F> static void timeIt(const char* name, F f)
+{
+    unsigned long calls = 0;
+    Clock::time_point start = Clock::now();
+    double elapsed;
+    do
+    {
+        for(int i = 0; i < 1000; i++) f();
+        calls += 1000;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    } while(elapsed < 0.2);
+    printf("%-28s %8.1f ns\n", name, elapsed * 1e9 / calls);
+}
+
+static void timing()
+{
+    uint8_t block[64] = {0};
+    uint8_t key[20] = {0};
+    uint8_t counter[8] = {0};
+    uint8_t hash[20];
+    HMAC_SHA1_Midstate mid;
+    HMAC_SHA1::midstate(key, sizeof(key), mid);
+
+    SHA1 sha1;
+    timeIt("SHA1 block", [&]{ sha1.update(block, 64); });
+    timeIt("HMAC_SHA1 from key", [&]{
+        HMAC_SHA1 hmac(key, sizeof(key));
+        hmac.update(counter, 8);
+        hmac.digest(key, sizeof(key), hash);
+    });
+    timeIt("HMAC_SHA1 from midstate", [&]{
+        HMAC_SHA1 hmac(mid);
+        hmac.update(counter, 8);
+        hmac.digest(mid, hash);
+    });
+    uint8_t password[6];
+    timeIt("otp", [&]{
+        otp(password, mid, counter);
+        counter[7]++;
+    });
+}
+
+int main()
+{
+    testSHA1<SHA1CompactTraits>("compact");
+    testSHA1<SHA1FastTraits>("fast");
+    //Again with the C++ rounds where the SHA extensions took them
+    if(SHA1::hardware())
+    {
+        SHA1::forceScalar(true);
+        testSHA1<SHA1CompactTraits>("compact scalar");
+        testSHA1<SHA1FastTraits>("fast scalar");
+        testHMAC();
+        testSHA1Steps<SHA1CompactTraits>("compact scalar");
+        testSHA1Steps<SHA1FastTraits>("fast scalar");
+        SHA1::forceScalar(false);
+    }
+    testMulti();
+    testHMAC();
+    testTOTP();
+    testSHA1Steps<SHA1CompactTraits>("compact");
+    testSHA1Steps<SHA1FastTraits>("fast");
+    testTOTPSteps();
+    testTOTPWindow();
+    testSecretDB();
+    testReplayCache();
+    testDrift();
+
+    timing();
+
+    if(failures)
+    {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("all tests passed\n");
+    return 0;
+}
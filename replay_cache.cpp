@@ -0,0 +1,71 @@
+/*
+
+An implementation of the RFC 6238 time based OTP protocol on an AtTiny85 microcontroller
+
+Copyright (C) 2017 Adam Reid
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#include "replay_cache.h"
+#include "user_hash.h"
+
+//Expiry times compare with wrap around, as the low 32 bits of Unix seconds
+static bool expired(uint64_t entry, uint32_t now)
+{
+    return !entry || (int32_t)((uint32_t)entry - now) <= 0;
+}
+
+OTP_ReplayCache::OTP_ReplayCache(size_t entries)
+{
+    uint64_t buckets = 1;
+    while(buckets < entries) buckets <<= 1;
+    mBuckets.reset(new Bucket[buckets]);
+    for(uint64_t i = 0; i < buckets; i++)
+    {
+        for(std::atomic<uint64_t>& e : mBuckets[i].entry) e.store(0, std::memory_order_relaxed);
+    }
+    mMask = buckets - 1;
+}
+
+//Returns true the first time a code is used. The loads after the claim are
+//sequentially consistent with the other thread's claim, so of two threads
+//claiming the same code at least one sees the other and refuses
+bool OTP_ReplayCache::use(uint64_t user, uint64_t expires, uint64_t now)
+{
+    uint64_t h = userHash(user);
+    Bucket& b = mBuckets[h & mMask];
+    uint64_t code = (h & 0xffffffff00000000ull) | (uint32_t)expires;
+
+    int claimed = -1;
+    for(int i = 0; i < 8; i++)
+    {
+        uint64_t e = b.entry[i].load();
+        if(e == code) return false;
+        if(claimed < 0 && expired(e, now))
+        {
+            if(b.entry[i].compare_exchange_strong(e, code)) claimed = i;
+            else if(e == code) return false;
+        }
+    }
+    if(claimed < 0) return false;
+
+    for(int i = 0; i < 8; i++)
+    {
+        if(i != claimed && b.entry[i].load() == code) return false;
+    }
+    return true;
+}
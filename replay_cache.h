@@ -0,0 +1,67 @@
+/*
+
+An implementation of the RFC 6238 time based OTP protocol on an AtTiny85 microcontroller
+
+Copyright (C) 2017 Adam Reid
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#ifndef _REPLAY_CACHE_H_
+#define _REPLAY_CACHE_H_
+
+#include <atomic>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+Used code cache for the host verifier, so an accepted code can't be accepted
+again as RFC 6238 section 5.2 requires. OTP_Verifier calls use() once a code
+matches, see verifier.h.
+
+A code is identified by the user and the time it stops being accepted,
+(step + window + 1) * period, which also stands for its step. An entry is free
+again once that time has passed, so the cache empties itself with no sweeping.
+
+The table is buckets of eight 64 bit entries, one cache line each, chosen by a
+hash of the user. An entry is 32 bits of the same hash with the 32 bit expiry
+time. All access is by atomic loads and compare and swap, with no locks. After
+claiming an entry use() checks the bucket again, so two threads racing with the
+same code can both be refused but never both accepted. Two users only mix up
+if they share the bucket and the 32 bit tag.
+
+A full bucket refuses the code, so size the cache for the codes accepted over
+one window; the table has a bucket for every expected entry.
+*/
+
+class OTP_ReplayCache
+{
+    public:
+    OTP_ReplayCache(size_t entries);
+    bool use(uint64_t user, uint64_t expires, uint64_t now);
+
+    private:
+    struct alignas(64) Bucket
+    {
+        std::atomic<uint64_t> entry[8];
+    };
+
+    std::unique_ptr<Bucket[]> mBuckets;
+    uint64_t mMask;
+};
+
+#endif
@@ -0,0 +1,190 @@
+/*
+
+An implementation of the RFC 6238 time based OTP protocol on an AtTiny85 microcontroller
+
+Copyright (C) 2017 Adam Reid
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#include "secret_db.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+static_assert(sizeof(OTP_Record) == 64, "a record is one cache line");
+static_assert(sizeof(OTP_DBHeader) == 64, "records start on a cache line");
+
+static const char dbMagic[8] = {'O', 'T', 'P', 'D', 'B', 0, 0, 1};
+static const uint32_t dbByteOrder = 0x01020304;
+
+//The splitmix64 finaliser, so sequential user IDs spread over the table
+static uint64_t slotHash(uint64_t user)
+{
+    user ^= user >> 30;
+    user *= 0xbf58476d1ce4e5b9ull;
+    user ^= user >> 27;
+    user *= 0x94d049bb133111ebull;
+    return user ^ (user >> 31);
+}
+
+//The limits of a token slot, setSecret() and loadKey() in main.cpp. otp() could
+//do 9 digits and 64 byte keys, but a user given those could never log in.
+static bool tokenKey(uint8_t digits, uint8_t period)
+{
+    return digits >= 6 && digits <= 8 && period != 0;
+}
+
+bool OTP_SecretStore::add(uint64_t user, const uint8_t* secret, uint8_t length, uint8_t digits, uint8_t period)
+{
+    if(length > 40 || !tokenKey(digits, period)) return false;
+
+    OTP_Key& k = mKeys[user];
+    HMAC_SHA1::midstate(secret, length, k.key);
+    k.digits = digits;
+    k.period = period;
+    return true;
+}
+
+const OTP_Key* OTP_SecretStore::find(uint64_t user) const
+{
+    std::unordered_map<uint64_t, OTP_Key>::const_iterator i = mKeys.find(user);
+    return i == mKeys.end() ? 0 : &i->second;
+}
+
+OTP_SecretDB::OTP_SecretDB():
+    mMap(0), mMapSize(0), mRecords(0), mMask(0), mCount(0)
+{
+}
+
+OTP_SecretDB::~OTP_SecretDB()
+{
+    close();
+}
+
+void OTP_SecretDB::close()
+{
+    if(mMap) munmap(mMap, mMapSize);
+    mMap = 0;
+    mMapSize = 0;
+    mRecords = 0;
+    mMask = 0;
+    mCount = 0;
+}
+
+bool OTP_SecretDB::open(const char* path)
+{
+    close();
+    int fd = ::open(path, O_RDONLY);
+    if(fd < 0) return false;
+
+    struct stat st;
+    void* map = MAP_FAILED;
+    if(!fstat(fd, &st) && (size_t)st.st_size >= sizeof(OTP_DBHeader))
+    {
+        map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if(map == MAP_FAILED) return false;
+
+    const OTP_DBHeader* h = (const OTP_DBHeader*)map;
+    uint64_t slots = h->slots;
+    if(memcmp(h->magic, dbMagic, sizeof(dbMagic)) || h->byteOrder != dbByteOrder ||
+       h->recordSize != sizeof(OTP_Record) || !slots || (slots & (slots - 1)) ||
+       (uint64_t)st.st_size != sizeof(OTP_DBHeader) + slots * sizeof(OTP_Record) ||
+       h->count > slots / 2)
+    {
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    //Lookups land anywhere in the file, read ahead would only waste page cache
+    madvise(map, st.st_size, MADV_RANDOM);
+    mMap = map;
+    mMapSize = st.st_size;
+    mRecords = (const OTP_Record*)(h + 1);
+    mMask = slots - 1;
+    mCount = h->count;
+    return true;
+}
+
+//The probe is bounded by the table size, so a damaged file with no empty
+//record can't hang a lookup. The file is trusted no more than that: a record
+//add() would not have made is not found, as the verifier divides by the period
+//and sizes its code buffers by the digits. The key length isn't stored, a
+//midstate looks the same whatever key it came from.
+const OTP_Key* OTP_SecretDB::find(uint64_t user) const
+{
+    if(!mRecords) return 0;
+    uint64_t i = slotHash(user) & mMask;
+    for(uint64_t n = 0; n <= mMask; n++, i = (i + 1) & mMask)
+    {
+        const OTP_Record& r = mRecords[i];
+        if(!r.key.digits) return 0;
+        if(r.user == user) return tokenKey(r.key.digits, r.key.period) ? &r.key : 0;
+    }
+    return 0;
+}
+
+bool OTP_SecretDB::write(const char* path, const OTP_SecretStore& store)
+{
+    uint64_t slots = 1;
+    while(slots < 2 * store.size()) slots <<= 1;
+
+    std::vector<OTP_Record> records(slots);
+    memset(records.data(), 0, slots * sizeof(OTP_Record));
+    for(const auto& k : store.keys())
+    {
+        uint64_t i = slotHash(k.first) & (slots - 1);
+        while(records[i].key.digits) i = (i + 1) & (slots - 1);
+        records[i].user = k.first;
+        records[i].key = k.second;
+    }
+
+    OTP_DBHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, dbMagic, sizeof(dbMagic));
+    h.byteOrder = dbByteOrder;
+    h.recordSize = sizeof(OTP_Record);
+    h.slots = slots;
+    h.count = store.size();
+
+    //Written beside the old file and renamed over it, so a verifier that has
+    //the old one mapped keeps reading it until it opens the new one.
+    //mkstemp() gives each writer its own name, and mode 0600 as befits secrets.
+    std::string temp = std::string(path) + ".XXXXXX";
+    int fd = mkstemp(&temp[0]);
+    if(fd < 0) return false;
+    FILE* f = fdopen(fd, "wb");
+    if(!f)
+    {
+        ::close(fd);
+        unlink(temp.c_str());
+        return false;
+    }
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(records.data(), sizeof(OTP_Record), slots, f) == slots;
+    ok = !fflush(f) && !fsync(fileno(f)) && ok;
+    ok = !fclose(f) && ok;
+    if(ok && !rename(temp.c_str(), path)) return true;
+    unlink(temp.c_str());
+    return false;
+}
@@ -0,0 +1,133 @@
+/*
+
+An implementation of the RFC 6238 time based OTP protocol on an AtTiny85 microcontroller
+
+Copyright (C) 2017 Adam Reid
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#ifndef _SECRET_DB_H_
+#define _SECRET_DB_H_
+
+#include "hmac_sha1.h"
+#include <stddef.h>
+#include <unordered_map>
+
+/*
+Secret storage for the host verifier, see verifier.h.
+
+A key is the HMAC midstate of a secret with its code length and time step, the
+same data a token slot holds, so verifying needs no key setup per request.
+
+OTP_SecretStore is an in memory map for building a set of keys. Add all users
+before verifying, lookups are not locked.
+
+OTP_SecretDB is the file format for provisioned tokens, opened with mmap so a
+verifier starts in milliseconds whatever the number of users. The file is a 64
+byte header followed by an open addressed hash table of 64 byte records, one
+cache line each, at most half full. A lookup hashes the user ID and reads
+records from there until it finds the user or an empty record, usually just
+the one line. Numbers are in host byte order, a file from a host of the other
+byte order is refused.
+
+write() builds the file under a unique name beside path (mkstemp(), mode 0600)
+and renames it over path. A verifier that has the old file open keeps a
+consistent copy and picks up the new one the next time it calls open().
+Concurrent writers don't share a temporary file, and the last rename wins.
+
+add() takes what a token slot can hold: keys of up to 40 bytes, 6 to 8 digits
+and a nonzero period. OTP_SecretDB::find() applies the same digits and period
+checks to every record it returns, and a damaged record reads as no user.
+
+Usage:
+
+OTP_SecretStore store;
+store.add(user, secret, length);        //6 digits, 30 seconds
+OTP_SecretDB::write("tokens.db", store);
+
+OTP_SecretDB db;
+db.open("tokens.db");
+OTP_Verifier verifier(db);
+*/
+
+struct OTP_Key
+{
+    HMAC_SHA1_Midstate key;
+    uint8_t digits;
+    uint8_t period;
+};
+
+class OTP_KeySource
+{
+    public:
+    virtual ~OTP_KeySource() {}
+    virtual const OTP_Key* find(uint64_t user) const = 0;
+};
+
+class OTP_SecretStore: public OTP_KeySource
+{
+    public:
+    bool add(uint64_t user, const uint8_t* secret, uint8_t length, uint8_t digits = 6, uint8_t period = 30);
+    const OTP_Key* find(uint64_t user) const;
+    size_t size() const { return mKeys.size(); }
+    const std::unordered_map<uint64_t, OTP_Key>& keys() const { return mKeys; }
+
+    private:
+    std::unordered_map<uint64_t, OTP_Key> mKeys;
+};
+
+//A record with digits 0 is empty
+struct alignas(64) OTP_Record
+{
+    uint64_t user;
+    OTP_Key key;
+};
+
+struct OTP_DBHeader
+{
+    char magic[8];
+    uint32_t byteOrder;
+    uint32_t recordSize;
+    uint64_t slots;
+    uint64_t count;
+    uint8_t reserved[32];
+};
+
+class OTP_SecretDB: public OTP_KeySource
+{
+    public:
+    OTP_SecretDB();
+    ~OTP_SecretDB();
+    bool open(const char* path);
+    void close();
+    const OTP_Key* find(uint64_t user) const;
+    size_t size() const { return mCount; }
+
+    static bool write(const char* path, const OTP_SecretStore& store);
+
+    private:
+    void* mMap;
+    size_t mMapSize;
+    const OTP_Record* mRecords;
+    uint64_t mMask;
+    size_t mCount;
+
+    OTP_SecretDB(const OTP_SecretDB&);
+    OTP_SecretDB& operator=(const OTP_SecretDB&);
+};
+
+#endif
@@ -21,16 +21,43 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include "sha1.h"
-#include <avr/pgmspace.h>
+#include "progmem.h"
+
+#ifdef SHA1_SHANI
+#include <cpuid.h>
+
+void sha1_compress_shani(uint32_t hash[5], const uint8_t block[64]);
+
+//SHA extensions are CPUID leaf 7 EBX bit 29, the code also needs SSE4.1
+static bool detectShaNi()
+{
+    unsigned int a, b, c, d;
+    if(!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_SSE4_1)) return false;
+    if(!__get_cpuid_count(7, 0, &a, &b, &c, &d)) return false;
+    return b & bit_SHA;
+}
+
+static bool scalarOnly = false;
+
+static bool haveShaNi()
+{
+    static const bool shaNi = detectShaNi();
+    return shaNi && !scalarOnly;
+}
+#endif
+
+#if defined(SHA1_ASM) && defined(__AVR__)
+extern "C" void sha1_compress_avr(uint32_t hash[5], uint32_t W[16]);
+#endif
 
 #define CircularShift(bits,word) (((word) << (bits)) | ((word) >> (32-(bits))))
 
-SHA1::SHA1()
+template<class Traits> SHA1Core<Traits>::SHA1Core()
 {
     reset();
 }
 
-void SHA1::reset()
+template<class Traits> void SHA1Core<Traits>::reset()
 {
     mBitCount = 0;
     mBlockIndex = 0;
@@ -41,46 +68,98 @@ void SHA1::reset()
     mHash[4]   = 0xC3D2E1F0;
 }
 
-void SHA1::digest(uint8_t hash[20])
+template<class Traits> void SHA1Core<Traits>::reset(const uint32_t state[5], uint8_t blocks)
+{
+    mBitCount = ((Count)blocks) << 9;
+    mBlockIndex = 0;
+    for(uint8_t i = 0; i < 5; ++i) mHash[i] = state[i];
+}
+
+template<class Traits> void SHA1Core<Traits>::midstate(uint32_t state[5])
+{
+    for(uint8_t i = 0; i < 5; ++i) state[i] = mHash[i];
+}
+
+//Pads mBlock after the 0x80 byte. Returns false if the bit count doesn't fit
+//and another block has to follow
+template<class Traits> bool SHA1Core<Traits>::closeBlock()
 {
-    if (mBlockIndex > 55)
+    uint8_t* block = bytes();
+    if(mBlockIndex > 56)
     {
-        mBlock[mBlockIndex++] = 0x80;
-        while(mBlockIndex < 64) mBlock[mBlockIndex++] = 0;
-        processBlock();
-        while(mBlockIndex < 56) mBlock[mBlockIndex++] = 0;
+        while(mBlockIndex < 64) block[mBlockIndex++] = 0;
+        return false;
     }
-    else
+    while(mBlockIndex < 56) block[mBlockIndex++] = 0;
+
+    Count bits = mBitCount;
+    for(uint8_t i = 63; i > 55; --i)
     {
-        mBlock[mBlockIndex++] = 0x80;
-        while(mBlockIndex < 56) mBlock[mBlockIndex++] = 0;
+        block[i] = bits;
+        bits >>= 8;
     }
-    
-    mBlock[56] = 0;
-    mBlock[57] = 0;
-    mBlock[58] = 0;
-    mBlock[59] = 0;
-    mBlock[60] = 0;
-    mBlock[61] = 0;
-    mBlock[62] = mBitCount >> 8;
-    mBlock[63] = mBitCount;
-    
-    processBlock();
-    
+    return true;
+}
+
+template<class Traits> void SHA1Core<Traits>::output(uint8_t hash[20])
+{
     for(uint8_t i = 0; i < 20; ++i)
     {
         hash[i] = mHash[i>>2] >> 8 * ( 3 - ( i & 0x03 ) );
     }
 }
 
-void SHA1::update(const uint8_t* m, uint8_t length)
+template<class Traits> void SHA1Core<Traits>::digest(uint8_t hash[20])
 {
-    while(length--)
+    bytes()[mBlockIndex++] = 0x80;
+    bool last;
+    do
     {
-        mBlock[mBlockIndex++] = *m;
-        mBitCount += 8;
-        if(mBlockIndex == 64) processBlock();
-        m++;
+        last = closeBlock();
+        processBlock(bytes());
+    } while(!last);
+
+    output(hash);
+}
+
+template<class Traits> void SHA1Core<Traits>::digestBegin(SHA1Resume& r)
+{
+    bytes()[mBlockIndex++] = 0x80;
+    r.last = closeBlock();
+    r.round = 0;
+}
+
+template<class Traits> bool SHA1Core<Traits>::digestStep(SHA1Resume& r, uint8_t hash[20], uint8_t rounds)
+{
+    if(!compressStep(r, rounds)) return false;
+    if(!r.last)
+    {
+        r.last = closeBlock();
+        return false;
+    }
+
+    output(hash);
+    return true;
+}
+
+template<class Traits> void SHA1Core<Traits>::update(const uint8_t* m, Length length)
+{
+    mBitCount += ((Count)length) << 3;
+    while(length)
+    {
+        //Whole blocks are compressed straight from the caller's buffer
+        if(mBlockIndex == 0 && length >= 64)
+        {
+            processBlock(m);
+            m += 64;
+            length -= 64;
+        }
+        else
+        {
+            bytes()[mBlockIndex++] = *m++;
+            length--;
+            if(mBlockIndex == 64) processBlock(bytes());
+        }
     }
 }
 
@@ -91,90 +170,198 @@ inline uint32_t extendBlock(uint32_t W[], uint8_t t)
     return CircularShift(1,W[(t-3)%16] ^ W[(t-8)%16] ^ W[(t-14)%16] ^ W[(t-16)%16]);
 }
 
-void SHA1::processBlock()
+//One round of group t/20. Extend is false for the first 16 rounds, which use
+//the message words directly
+template<uint8_t Group, bool Extend> inline __attribute__((always_inline))
+static void roundStep(uint8_t t, uint32_t W[], uint32_t& A, uint32_t& B, uint32_t& C, uint32_t& D, uint32_t& E)
 {
-    uint32_t* W = (uint32_t*) mBlock; 
-    //Re-order bytes to little endian 32 bit words
-    for(uint8_t t = 0; t < 16; t++)
+    uint32_t Wt;
+    if(Extend)
     {
-        uint32_t Wt = ((uint32_t)mBlock[t * 4]) << 24;
-        Wt |= ((uint32_t)mBlock[t * 4 + 1]) << 16;
-        Wt |= ((uint32_t)mBlock[t * 4 + 2]) << 8;
-        Wt |= ((uint32_t)mBlock[t * 4 + 3]);
-        W[t] = Wt;
+        Wt = extendBlock(W, t);
+        W[t%16] = Wt;
     }
-    
-    uint32_t A = mHash[0];
-    uint32_t B = mHash[1];
-    uint32_t C = mHash[2];
-    uint32_t D = mHash[3];
-    uint32_t E = mHash[4];
-    
+    else Wt = W[t];
+
+    uint32_t f;
+    if(Group == 0) f = (B & C) | ((~B) & D);
+    else if(Group == 2) f = (B & C) | (B & D) | (C & D);
+    else f = B ^ C ^ D;
+
+    uint32_t temp = CircularShift(5,A) + f + E + Wt + K[Group];
+    E = D;
+    D = C;
+    C = CircularShift(30,B);
+    B = A;
+    A = temp;
+}
+
+//Rounds From to To-1. The loop is written twice so that only the fast traits
+//get the unroll pragma
+template<class Traits, uint8_t From, uint8_t To> inline __attribute__((always_inline))
+static void rounds(uint32_t W[], uint32_t& A, uint32_t& B, uint32_t& C, uint32_t& D, uint32_t& E)
+{
+    if(Traits::unroll)
+    {
+        #pragma GCC unroll 20
+        for(uint8_t t = From; t < To; t++) roundStep<From / 20, (From >= 16)>(t, W, A, B, C, D, E);
+    }
+    else
+    {
+        for(uint8_t t = From; t < To; t++) roundStep<From / 20, (From >= 16)>(t, W, A, B, C, D, E);
+    }
+}
+
+//Re-order bytes to little endian 32 bit words. W may be block itself
+static inline void loadSchedule(const uint8_t* block, uint32_t W[])
+{
     for(uint8_t t = 0; t < 16; t++)
     {
-        uint32_t temp =  CircularShift(5,A) + ((B & C) | ((~B) & D)) + E + W[t] + K[0];
-        E = D;
-        D = C;
-        C = CircularShift(30,B);
-        B = A;
-        A = temp;
+        uint32_t Wt = ((uint32_t)block[t * 4]) << 24;
+        Wt |= ((uint32_t)block[t * 4 + 1]) << 16;
+        Wt |= ((uint32_t)block[t * 4 + 2]) << 8;
+        Wt |= ((uint32_t)block[t * 4 + 3]);
+        W[t] = Wt;
     }
-    
-    for(uint8_t t = 16; t < 20; t++)
+}
+
+//Runs up to rounds rounds of the compression of mBlock, with the schedule built
+//in place whatever the traits. The round function is chosen at run time so the
+//AVR carries one more copy of a round rather than five.
+template<class Traits> bool SHA1Core<Traits>::compressStep(SHA1Resume& r, uint8_t rounds)
+{
+    if(rounds == 0) return false;
+    uint32_t* W = mBlock;
+    if(r.round == 0)
     {
-        uint32_t Wt = extendBlock(W, t);
-        W[t%16] = Wt;
-        uint32_t temp =  CircularShift(5,A) + ((B & C) | ((~B) & D)) + E + Wt + K[0];
-        E = D;
-        D = C;
-        C = CircularShift(30,B);
-        B = A;
-        A = temp;
+        if(rounds >= 80)
+        {
+            processBlock(bytes());
+            return true;
+        }
+        loadSchedule(bytes(), W);
+        for(uint8_t i = 0; i < 5; ++i) r.work[i] = mHash[i];
     }
-    
-    for(uint8_t t = 20; t < 40; t++)
+
+    uint32_t A = r.work[0];
+    uint32_t B = r.work[1];
+    uint32_t C = r.work[2];
+    uint32_t D = r.work[3];
+    uint32_t E = r.work[4];
+
+    for(; rounds && r.round < 80; rounds--)
     {
-        uint32_t Wt = extendBlock(W, t);
-        W[t%16] = Wt;
-        uint32_t temp = CircularShift(5,A) + (B ^ C ^ D) + E + Wt + K[1];
+        uint8_t t = r.round++;
+        uint32_t Wt;
+        if(t < 16) Wt = W[t];
+        else
+        {
+            Wt = extendBlock(W, t);
+            W[t%16] = Wt;
+        }
+
+        uint32_t f;
+        if(t < 20) f = (B & C) | ((~B) & D);
+        else if(t >= 40 && t < 60) f = (B & C) | (B & D) | (C & D);
+        else f = B ^ C ^ D;
+
+        uint32_t temp = CircularShift(5,A) + f + E + Wt + pgm_read_dword(&K[t / 20]);
         E = D;
         D = C;
         C = CircularShift(30,B);
         B = A;
         A = temp;
     }
-    
-    for(uint8_t t = 40; t < 60; t++)
+
+    if(r.round < 80)
     {
-        uint32_t Wt = extendBlock(W, t);
-        W[t%16] = Wt;
-        uint32_t temp = CircularShift(5,A) +
-        ((B & C) | (B & D) | (C & D)) + E + Wt + K[2];
-        E = D;
-        D = C;
-        C = CircularShift(30,B);
-        B = A;
-        A = temp;
+        r.work[0] = A;
+        r.work[1] = B;
+        r.work[2] = C;
+        r.work[3] = D;
+        r.work[4] = E;
+        return false;
     }
-    
-    for(uint8_t t = 60; t < 80; t++)
+
+    mHash[0] += A;
+    mHash[1] += B;
+    mHash[2] += C;
+    mHash[3] += D;
+    mHash[4] += E;
+    mBlockIndex = 0;
+    r.round = 0;
+    return true;
+}
+
+#ifndef __AVR__
+template<class Traits> const char* SHA1Core<Traits>::engine()
+{
+    return hardware() ? "sha-ni" : "scalar";
+}
+
+template<class Traits> bool SHA1Core<Traits>::hardware()
+{
+#ifdef SHA1_SHANI
+    return haveShaNi();
+#else
+    return false;
+#endif
+}
+
+template<class Traits> void SHA1Core<Traits>::forceScalar(bool scalar)
+{
+#ifdef SHA1_SHANI
+    scalarOnly = scalar;
+#endif
+}
+#endif
+
+//block is either mBlock or a whole block of caller data. With the in place
+//schedule the message words are built in mBlock, so any partial block there is lost
+template<class Traits> void SHA1Core<Traits>::processBlock(const uint8_t* block)
+{
+#ifdef SHA1_SHANI
+    if(haveShaNi())
     {
-        uint32_t Wt = extendBlock(W, t);
-        W[t%16] = Wt;
-        uint32_t temp = CircularShift(5,A) + (B ^ C ^ D) + E + Wt + K[3];
-        E = D;
-        D = C;
-        C = CircularShift(30,B);
-        B = A;
-        A = temp;
+        sha1_compress_shani(mHash, block);
+        mBlockIndex = 0;
+        return;
     }
+#endif
+
+    uint32_t schedule[Traits::inPlaceSchedule ? 1 : 16];
+    uint32_t* W = Traits::inPlaceSchedule ? mBlock : schedule;
+    loadSchedule(block, W);
+
+#if defined(SHA1_ASM) && defined(__AVR__)
+    sha1_compress_avr(mHash, W);
+#else
+    uint32_t A = mHash[0];
+    uint32_t B = mHash[1];
+    uint32_t C = mHash[2];
+    uint32_t D = mHash[3];
+    uint32_t E = mHash[4];
+    
+    rounds<Traits, 0, 16>(W, A, B, C, D, E);
+    rounds<Traits, 16, 20>(W, A, B, C, D, E);
+    rounds<Traits, 20, 40>(W, A, B, C, D, E);
+    rounds<Traits, 40, 60>(W, A, B, C, D, E);
+    rounds<Traits, 60, 80>(W, A, B, C, D, E);
     
     mHash[0] += A;
     mHash[1] += B;
     mHash[2] += C;
     mHash[3] += D;
     mHash[4] += E;
+#endif
     
     mBlockIndex = 0;
 }
 
+//The AVR build only carries the default layout
+#ifdef __AVR__
+template class SHA1Core<SHA1::Layout>;
+#else
+template class SHA1Core<SHA1CompactTraits>;
+template class SHA1Core<SHA1FastTraits>;
+#endif
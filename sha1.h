@@ -24,13 +24,23 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define _SHA1_H_
 
 #include <stdint.h>
+#include <stddef.h>
 
 /*
 An implementation of the SHA1 hash algorithm that uses a minimal amount of memory.
 Runs on AtTiny microcontrollers with 512 bytes of RAM. Might run with 256 bytes of RAM.
 
-As this code is intended for an MCU it only supports adding 255 message bytes at a time
-and a maximum message length of 2^16 bits
+The algorithm is written once in SHA1Core and the storage choices come from a
+traits class:
+
+SHA1CompactTraits: for the AVR. update() takes at most 255 bytes per call,
+    messages are limited to 2^16 bits, the message schedule is built in place
+    in the block buffer and the rounds are loops.
+SHA1FastTraits: for hosts. update() takes a size_t, the bit count is 64 bits,
+    the message schedule is a local array and the 80 rounds are fully unrolled.
+
+SHA1 is SHA1Core with the default traits, chosen by SHA1_LARGE_MESSAGES. It
+defaults to 0 (compact) on the AVR and 1 (fast) elsewhere.
 
 
 Usage: Follows the Python hashlib interface
@@ -42,23 +52,102 @@ uint8_t digest[20];
 sha1.digest(digest);
 //call SHA1::reset() if you want to start a new hash
 
+The chaining state after a whole number of blocks can be saved with SHA1::midstate()
+and later resumed with SHA1::reset(state, blocks). HMAC_SHA1 uses this to skip
+hashing the padded key on every message.
+
+digest() can also be run in slices so a caller can keep servicing other work:
+
+SHA1Resume r;
+sha1.digestBegin(r);
+while(!sha1.digestStep(r, digest, 16)) poll(); //at most 16 rounds per call
+
+The round state lives in the SHA1Resume the caller keeps, so SHA1 objects that
+are never stepped don't carry it. A step of 80 rounds or more at the start of a
+block compresses the whole block with the normal engine, shorter steps use
+plain C rounds on every build.
+
+Host builds compiled with SHA1_SHANI defined check CPUID once and use the x86 SHA
+extensions for the compression function when available. SHA1::engine() reports
+which implementation is in use, SHA1::hardware() whether it is the SHA
+extensions, and SHA1::forceScalar(true) turns the extensions
+off for every layout, so tests can cover the C++ rounds on any host. AVR builds compiled with SHA1_ASM defined run the
+rounds in hand written assembly (sha1_avr.S).
+
 */
 
-class SHA1
+struct SHA1CompactTraits
+{
+    typedef uint8_t Length;
+    typedef uint16_t Count;
+    static const bool inPlaceSchedule = true;
+    static const bool unroll = false;
+};
+
+struct SHA1FastTraits
+{
+    typedef size_t Length;
+    typedef uint64_t Count;
+    static const bool inPlaceSchedule = false;
+    static const bool unroll = true;
+};
+
+struct SHA1Resume
+{
+    uint32_t work[5];
+    uint8_t round;
+    uint8_t last;
+};
+
+template<class Traits> class SHA1Core
 {
     public:
-    SHA1();
+    typedef Traits Layout;
+    typedef typename Traits::Length Length;
+    typedef typename Traits::Count Count;
+
+    SHA1Core();
     void reset();
-    void update(const uint8_t* m, uint8_t length);
+    void reset(const uint32_t state[5], uint8_t blocks);
+    void midstate(uint32_t state[5]);
+    void update(const uint8_t* m, Length length);
     void digest(uint8_t hash[20]);
+    void digestBegin(SHA1Resume& r);
+    bool digestStep(SHA1Resume& r, uint8_t hash[20], uint8_t rounds);
+#ifndef __AVR__
+    static const char* engine();
+    static bool hardware();
+    static void forceScalar(bool scalar);
+#endif
 
     private:
     uint32_t mHash[5]; 
-    uint16_t mBitCount; 
+    Count mBitCount; 
     uint8_t mBlockIndex;
-    uint8_t mBlock[64];
+    uint32_t mBlock[16];
 
-    void processBlock();
+    //The block is stored as words so the in place schedule is aligned
+    uint8_t* bytes() { return (uint8_t*) mBlock; }
+
+    void processBlock(const uint8_t* block);
+    bool compressStep(SHA1Resume& r, uint8_t rounds);
+    bool closeBlock();
+    void output(uint8_t hash[20]);
 };
 
+#ifndef SHA1_LARGE_MESSAGES
+#ifdef __AVR__
+#define SHA1_LARGE_MESSAGES 0
+#else
+#define SHA1_LARGE_MESSAGES 1
+#endif
+#endif
+
+#if SHA1_LARGE_MESSAGES
+typedef SHA1Core<SHA1FastTraits> SHA1;
+#else
+typedef SHA1Core<SHA1CompactTraits> SHA1;
+#endif
+typedef SHA1::Length sha1_length_t;
+
 #endif
@@ -0,0 +1,95 @@
+/*
+
+An implementation of the RFC 6238 time based OTP protocol on an AtTiny85 microcontroller
+
+Copyright (C) 2017 Adam Reid
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+#include "sha1_multi.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA1_MULTI_X86
+#endif
+
+void sha1_multi_compress_sse2(uint32_t state[][5], const uint8_t* const block[]);
+void sha1_multi_words_sse2(uint32_t* state, const uint32_t* words);
+#ifdef SHA1_MULTI_X86
+void sha1_multi_compress_avx2(uint32_t state[][5], const uint8_t* const block[]);
+void sha1_multi_words_avx2(uint32_t* state, const uint32_t* words);
+void sha1_multi_compress_avx512(uint32_t state[][5], const uint8_t* const block[]);
+void sha1_multi_words_avx512(uint32_t* state, const uint32_t* words);
+#endif
+
+SHA1_Multi::SHA1_Multi(uint8_t maxLanes)
+{
+#ifdef SHA1_MULTI_X86
+    __builtin_cpu_init();
+    if(maxLanes >= 16 && __builtin_cpu_supports("avx512f"))
+    {
+        mLanes = 16;
+        mName = "avx512";
+        mKernel = sha1_multi_compress_avx512;
+        mWordKernel = sha1_multi_words_avx512;
+        return;
+    }
+    if(maxLanes >= 8 && __builtin_cpu_supports("avx2"))
+    {
+        mLanes = 8;
+        mName = "avx2";
+        mKernel = sha1_multi_compress_avx2;
+        mWordKernel = sha1_multi_words_avx2;
+        return;
+    }
+    mName = "sse2";
+#else
+    mName = "generic";
+#endif
+    mLanes = 4;
+    mKernel = sha1_multi_compress_sse2;
+    mWordKernel = sha1_multi_words_sse2;
+}
+
+void SHA1_Multi::compress(uint32_t state[][5], const uint8_t* const block[], size_t count) const
+{
+    while(count >= mLanes)
+    {
+        mKernel(state, block);
+        state += mLanes;
+        block += mLanes;
+        count -= mLanes;
+    }
+    if(count == 0) return;
+
+    //Fill the unused lanes of the last group with copies of the first message
+    uint32_t partialState[16][5];
+    const uint8_t* partialBlock[16];
+    for(uint8_t i = 0; i < mLanes; i++)
+    {
+        memcpy(partialState[i], state[i < count ? i : 0], sizeof(partialState[i]));
+        partialBlock[i] = block[i < count ? i : 0];
+    }
+    mKernel(partialState, partialBlock);
+    memcpy(state, partialState, count * sizeof(partialState[0]));
+}
+
+void SHA1_Multi::compressWords(uint32_t state[5][16], const uint32_t W[16][16], uint8_t count) const
+{
+    for(uint8_t i = 0; i < count && i < 16; i += mLanes) mWordKernel(&state[0][i], &W[0][i]);
+}
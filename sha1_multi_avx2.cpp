@@ -0,0 +1,41 @@
+/*
+
+An implementation of the RFC 6238 time based OTP protocol on an AtTiny85 microcontroller
+
+Copyright (C) 2017 Adam Reid
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+#include "sha1_multi.h"
+#include "sha1_multi_kernel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+typedef uint32_t Lanes8 __attribute__((vector_size(32)));
+
+void sha1_multi_compress_avx2(uint32_t state[][5], const uint8_t* const block[])
+{
+    compressLanes<Lanes8, 8>(state, block);
+}
+
+void sha1_multi_words_avx2(uint32_t* state, const uint32_t* words)
+{
+    compressWordLanes<Lanes8>(state, words);
+}
+
+#endif
@@ -0,0 +1,144 @@
+/*
+
+An implementation of the RFC 6238 time based OTP protocol on an AtTiny85 microcontroller
+
+Copyright (C) 2017 Adam Reid
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+#ifndef _SHA1_MULTI_KERNEL_H_
+#define _SHA1_MULTI_KERNEL_H_
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+Lane parallel SHA1 compression written with GCC vector extensions. Included by
+one source file per instruction set, each compiled with the matching -m flags,
+so everything here has internal linkage.
+*/
+
+#define VCircularShift(bits,word) (((word) << (bits)) | ((word) >> (32-(bits))))
+
+template<class V> static inline V extendBlock(V W[], uint8_t t)
+{
+    return VCircularShift(1,W[(t-3)%16] ^ W[(t-8)%16] ^ W[(t-14)%16] ^ W[(t-16)%16]);
+}
+
+//The 80 rounds on lane vectors, adding the result into A to E
+template<class V> static inline __attribute__((always_inline)) void roundsLanes(V W[16], V& A, V& B, V& C, V& D, V& E)
+{
+    const V A0 = A, B0 = B, C0 = C, D0 = D, E0 = E;
+
+    //Fully unrolled so the round function and constant are selected at compile time
+#pragma GCC unroll 80
+    for(uint8_t t = 0; t < 80; t++)
+    {
+        V Wt;
+        if(t < 16) Wt = W[t];
+        else
+        {
+            Wt = extendBlock(W, t);
+            W[t%16] = Wt;
+        }
+
+        V f;
+        uint32_t K;
+        if(t < 20)
+        {
+            f = (B & C) | ((~B) & D);
+            K = 0x5A827999;
+        }
+        else if(t < 40)
+        {
+            f = B ^ C ^ D;
+            K = 0x6ED9EBA1;
+        }
+        else if(t < 60)
+        {
+            f = (B & C) | (B & D) | (C & D);
+            K = 0x8F1BBCDC;
+        }
+        else
+        {
+            f = B ^ C ^ D;
+            K = 0xCA62C1D6;
+        }
+
+        V temp = VCircularShift(5,A) + f + E + Wt + K;
+        E = D;
+        D = C;
+        C = VCircularShift(30,B);
+        B = A;
+        A = temp;
+    }
+
+    A += A0;
+    B += B0;
+    C += C0;
+    D += D0;
+    E += E0;
+}
+
+//One 64 byte block and chaining state per lane, gathered into the lanes
+template<class V, int N> static inline void compressLanes(uint32_t state[][5], const uint8_t* const block[])
+{
+    V W[16];
+    for(uint8_t t = 0; t < 16; t++)
+    {
+        for(int i = 0; i < N; i++)
+        {
+            uint32_t Wt;
+            memcpy(&Wt, block[i] + t * 4, 4);
+            W[t][i] = __builtin_bswap32(Wt);
+        }
+    }
+
+    V A, B, C, D, E;
+    for(int i = 0; i < N; i++)
+    {
+        A[i] = state[i][0];
+        B[i] = state[i][1];
+        C[i] = state[i][2];
+        D[i] = state[i][3];
+        E[i] = state[i][4];
+    }
+    roundsLanes(W, A, B, C, D, E);
+    for(int i = 0; i < N; i++)
+    {
+        state[i][0] = A[i];
+        state[i][1] = B[i];
+        state[i][2] = C[i];
+        state[i][3] = D[i];
+        state[i][4] = E[i];
+    }
+}
+
+//Message words and state already laid out by lane, rows of 16 words with lane
+//i in column i, so every vector is one load or store
+template<class V> static inline void compressWordLanes(uint32_t* state, const uint32_t* words)
+{
+    V W[16];
+    for(uint8_t t = 0; t < 16; t++) memcpy(&W[t], words + 16 * t, sizeof(V));
+    V S[5];
+    for(uint8_t w = 0; w < 5; w++) memcpy(&S[w], state + 16 * w, sizeof(V));
+    roundsLanes(W, S[0], S[1], S[2], S[3], S[4]);
+    for(uint8_t w = 0; w < 5; w++) memcpy(state + 16 * w, &S[w], sizeof(V));
+}
+
+#endif
@@ -0,0 +1,86 @@
+/*
+
+An implementation of the RFC 6238 time based OTP protocol on an AtTiny85 microcontroller
+
+Copyright (C) 2017 Adam Reid
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+/*
+SHA1 compression using the x86 SHA extensions. This file is compiled with
+-msha -msse4.1 and SHA1::processBlock() only calls it after CPUID has reported
+support for both.
+*/
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <stdint.h>
+#include <immintrin.h>
+
+static inline __m128i rounds4(__m128i abcd, __m128i e, uint8_t f)
+{
+    //sha1rnds4 takes the round function as an immediate
+    switch(f)
+    {
+        case 0: return _mm_sha1rnds4_epu32(abcd, e, 0);
+        case 1: return _mm_sha1rnds4_epu32(abcd, e, 1);
+        case 2: return _mm_sha1rnds4_epu32(abcd, e, 2);
+        default: return _mm_sha1rnds4_epu32(abcd, e, 3);
+    }
+}
+
+void sha1_compress_shani(uint32_t hash[5], const uint8_t block[64])
+{
+    const __m128i byteSwap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+    __m128i ABCD = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)hash), 0x1B);
+    __m128i E[2];
+    E[0] = _mm_set_epi32(hash[4], 0, 0, 0);
+    const __m128i ABCD0 = ABCD;
+    const __m128i E0 = E[0];
+
+    //M[i%4] holds the message words for rounds 4i to 4i+3, the later ones are
+    //built up over the three groups before they are needed
+    __m128i M[4];
+    for(uint8_t i = 0; i < 4; i++)
+    {
+        M[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 16 * i)), byteSwap);
+    }
+
+#pragma GCC unroll 20
+    for(uint8_t i = 0; i < 20; i++)
+    {
+        __m128i& Ein = E[i & 1];
+        __m128i& Eout = E[(i + 1) & 1];
+        if(i == 0) Ein = _mm_add_epi32(Ein, M[0]);
+        else Ein = _mm_sha1nexte_epu32(Ein, M[i % 4]);
+        Eout = ABCD;
+        if(i >= 3 && i < 19) M[(i + 1) % 4] = _mm_sha1msg2_epu32(M[(i + 1) % 4], M[i % 4]);
+        ABCD = rounds4(ABCD, Ein, i / 5);
+        if(i >= 1 && i < 17) M[(i + 3) % 4] = _mm_sha1msg1_epu32(M[(i + 3) % 4], M[i % 4]);
+        if(i >= 2 && i < 18) M[(i + 2) % 4] = _mm_xor_si128(M[(i + 2) % 4], M[i % 4]);
+    }
+
+    E[0] = _mm_sha1nexte_epu32(E[0], E0);
+    ABCD = _mm_add_epi32(ABCD, ABCD0);
+
+    _mm_storeu_si128((__m128i*)hash, _mm_shuffle_epi32(ABCD, 0x1B));
+    hash[4] = _mm_extract_epi32(E[0], 3);
+}
+
+#endif
@@ -0,0 +1,47 @@
+/*
+
+An implementation of the RFC 6238 time based OTP protocol on an AtTiny85 microcontroller
+
+Copyright (C) 2017 Adam Reid
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#ifndef _SIM_MARKERS_H_
+#define _SIM_MARKERS_H_
+
+/*
+Phase markers for the simavr benchmark (make sim-bench). Firmware built with
+OTP_SIM writes the marker to GPIOR0 as the clock sync and each phase of a
+button press start and sim/otp_sim.cpp records the cycle count of every write.
+The finished password is written a digit at a time to GPIOR1. Without OTP_SIM
+the markers compile to nothing.
+*/
+
+#define SIM_MARK_SYNC      1   // syncClock(): RTC read and epoch conversion
+#define SIM_MARK_TIMESTAMP 2   // getTimestamp(): counter from the running clock
+#define SIM_MARK_PASSWORD  3   // getPassword(): check of the cached key
+#define SIM_MARK_OTP       4   // otp(): HMAC and truncation
+#define SIM_MARK_DONE      5
+
+#if defined(OTP_SIM) && defined(__AVR__)
+#define SIM_MARK(m) (GPIOR0 = (m))
+#define SIM_OUTPUT GPIOR1
+#else
+#define SIM_MARK(m)
+#endif
+
+#endif
@@ -0,0 +1,431 @@
+/*
+
+An implementation of the RFC 6238 time based OTP protocol on an AtTiny85 microcontroller
+
+Copyright (C) 2017 Adam Reid
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+/*
+Cycle counting harness for the firmware, built on simavr. Loads avr-otp-sim
+(the firmware built with OTP_SIM) into a simulated ATtiny85 with
+
+  - an EEPROM with the RFC 6238 test secret in slot 0 (HMAC midstate, 6
+    digits, 30 seconds)
+  - a DS1307 style RTC at I2C address 0x68 on the USI pins (SDA PB0, SCL PB2)
+
+syncs the firmware clock from the RTC, runs one button press and reports the
+cycles spent in each phase, using the markers from sim/markers.h. The password
+is checked against the host build of otp() and the cycle counts against a
+baseline file.
+
+Usage: otp-sim firmware.elf baseline [--update]
+
+A phase fails if it is more than 1% slower than the baseline. A missing or
+unreadable baseline fails the run too, --update records the current counts
+instead.
+
+simavr does not model the USI, so this file does: writes to USICR, USISR and
+USIDR are intercepted and the two wire mode clock strobe, 4 bit counter, shift
+register and SDA output latch are emulated well enough for the AVR310 driver
+in usi_twi_master.c. The slave sees the resulting SDA/SCL levels.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_io.h>
+#include <simavr/avr_ioport.h>
+#include <simavr/avr_eeprom.h>
+#include "otp.h"
+#include "sim/markers.h"
+
+//ATtiny85 data space addresses (I/O address + 0x20)
+#define GPIOR0_ADDR 0x31
+#define GPIOR1_ADDR 0x32
+#define USICR_ADDR  0x2D
+#define USISR_ADDR  0x2E
+#define USIDR_ADDR  0x2F
+#define PINB_ADDR   0x36
+#define DDRB_ADDR   0x37
+#define PORTB_ADDR  0x38
+
+#define SDA_BIT 0
+#define SCL_BIT 2
+#define USIOIF 6
+#define USITC 0
+
+#define RTC_ADDRESS 0x68
+
+//Time held by the RTC, 2026-10-17 12:34:56 UTC
+static const uint8_t rtcTime[8] = {0x56, 0x34, 0x12, 0x07, 0x17, 0x10, 0x26, 0x03};
+static const time_t rtcEpoch = 1792240496;
+
+//RFC 6238 SHA1 test secret
+static const char* secret = "12345678901234567890";
+
+struct Bus
+{
+    avr_t* avr;
+    avr_irq_t* scl;
+    avr_irq_t* sda;
+    uint8_t latch;          // USI SDA output latch
+    bool sclHigh;
+    bool sdaLine;
+
+    //DS1307 model
+    enum { IDLE, ADDRESS, WRITE, READ } state;
+    uint8_t registers[64];
+    uint8_t pointer;
+    uint8_t bit;            // rising SCL edges in the current byte, 9th is the ACK
+    uint8_t shift;
+    uint8_t out;            // byte being sent to the master
+    bool first;             // next written byte is the register pointer
+    bool read;
+    bool nack;
+    bool slaveSda;
+    unsigned transactions;
+};
+
+static Bus bus;
+
+static bool masterSda()
+{
+    uint8_t* data = bus.avr->data;
+    if(!(data[DDRB_ADDR] & (1 << SDA_BIT))) return true;
+    return (data[PORTB_ADDR] & (1 << SDA_BIT)) && bus.latch;
+}
+
+static void updateLatch()
+{
+    //The latch is transparent while SCL is low
+    if(!bus.sclHigh) bus.latch = bus.avr->data[USIDR_ADDR] >> 7;
+}
+
+static void slaveRising(bool sda)
+{
+    if(bus.state == Bus::IDLE) return;
+    bus.bit++;
+    if(bus.bit <= 8)
+    {
+        if(bus.state != Bus::READ) bus.shift = (bus.shift << 1) | sda;
+    }
+    else if(bus.state == Bus::READ) bus.nack = sda;
+}
+
+static void slaveFalling()
+{
+    if(bus.state == Bus::IDLE) return;
+    if(bus.bit == 8)
+    {
+        if(bus.state == Bus::ADDRESS)
+        {
+            bool match = (bus.shift >> 1) == RTC_ADDRESS;
+            bus.read = bus.shift & 1;
+            bus.slaveSda = !match;
+            if(!match) bus.state = Bus::IDLE;
+        }
+        else if(bus.state == Bus::WRITE)
+        {
+            if(bus.first) bus.pointer = bus.shift & 0x3f;
+            else bus.registers[bus.pointer++ & 0x3f] = bus.shift;
+            bus.first = false;
+            bus.slaveSda = false;
+        }
+        else bus.slaveSda = true;
+    }
+    else if(bus.bit == 9)
+    {
+        bus.bit = 0;
+        bus.slaveSda = true;
+        if(bus.state == Bus::ADDRESS)
+        {
+            bus.state = bus.read ? Bus::READ : Bus::WRITE;
+            bus.first = true;
+        }
+        else if(bus.state == Bus::READ && bus.nack) bus.state = Bus::IDLE;
+        if(bus.state == Bus::READ)
+        {
+            bus.out = bus.registers[bus.pointer++ & 0x3f];
+            bus.slaveSda = bus.out >> 7;
+        }
+    }
+    else if(bus.state == Bus::READ && bus.bit > 0)
+    {
+        bus.slaveSda = (bus.out >> (7 - bus.bit)) & 1;
+    }
+}
+
+//Called whenever anything that drives SCL or SDA may have changed
+static void updateBus()
+{
+    bool scl = bus.avr->data[PORTB_ADDR] & (1 << SCL_BIT);
+    if(scl != bus.sclHigh)
+    {
+        bus.sclHigh = scl;
+        if(scl) slaveRising(masterSda() && bus.slaveSda);
+        else slaveFalling();
+    }
+    updateLatch();
+
+    bool sda = masterSda() && bus.slaveSda;
+    if(sda != bus.sdaLine && bus.sclHigh)
+    {
+        if(!sda)
+        {
+            bus.state = Bus::ADDRESS;
+            bus.bit = 0;
+            bus.shift = 0;
+            bus.transactions++;
+        }
+        else bus.state = Bus::IDLE;
+        bus.slaveSda = true;
+        sda = masterSda();
+    }
+    bus.sdaLine = sda;
+}
+
+static void pinChanged(avr_irq_t* irq, uint32_t value, void* param)
+{
+    updateBus();
+}
+
+static void setScl(bool high)
+{
+    uint8_t* data = bus.avr->data;
+    if(high)
+    {
+        data[PORTB_ADDR] |= 1 << SCL_BIT;
+        data[PINB_ADDR] |= 1 << SCL_BIT;
+    }
+    else
+    {
+        data[PORTB_ADDR] &= ~(1 << SCL_BIT);
+        data[PINB_ADDR] &= ~(1 << SCL_BIT);
+    }
+    //Keep the port model's view of the pin in step, this also calls updateBus()
+    avr_raise_irq(bus.scl, high);
+    updateBus();
+}
+
+static void usicrWrite(avr_t* avr, avr_io_addr_t addr, uint8_t v, void* param)
+{
+    avr->data[addr] = v & ~(1 << USITC);
+    if(!(v & (1 << USITC))) return;
+
+    //Clock strobe: toggle SCL, shift on the rising edge, count both edges
+    bool rising = !bus.sclHigh;
+    bool sda = masterSda() && bus.slaveSda;
+    setScl(rising);
+    if(rising) avr->data[USIDR_ADDR] = (avr->data[USIDR_ADDR] << 1) | sda;
+    uint8_t count = (avr->data[USISR_ADDR] + 1) & 0x0f;
+    avr->data[USISR_ADDR] = (avr->data[USISR_ADDR] & 0xf0) | count;
+    if(count == 0) avr->data[USISR_ADDR] |= 1 << USIOIF;
+}
+
+static void usisrWrite(avr_t* avr, avr_io_addr_t addr, uint8_t v, void* param)
+{
+    //Flags are cleared by writing one, the low nibble sets the counter
+    uint8_t flags = avr->data[addr] & 0xf0 & ~(v & 0xe0);
+    avr->data[addr] = flags | (v & 0x0f);
+}
+
+static void usidrWrite(avr_t* avr, avr_io_addr_t addr, uint8_t v, void* param)
+{
+    avr->data[addr] = v;
+    updateBus();
+}
+
+struct Marks
+{
+    avr_cycle_count_t cycle[SIM_MARK_DONE + 1];
+    char password[7];
+    uint8_t digits;
+};
+
+static Marks marks;
+
+static void markWrite(avr_t* avr, avr_io_addr_t addr, uint8_t v, void* param)
+{
+    avr->data[addr] = v;
+    if(v <= SIM_MARK_DONE) marks.cycle[v] = avr->cycle;
+}
+
+static void outputWrite(avr_t* avr, avr_io_addr_t addr, uint8_t v, void* param)
+{
+    avr->data[addr] = v;
+    if(marks.digits < 6) marks.password[marks.digits++] = v;
+}
+
+struct Phase
+{
+    const char* name;
+    uint8_t from;
+    uint8_t to;
+};
+
+static const Phase phases[] = {
+    {"syncClock",    SIM_MARK_SYNC,      SIM_MARK_TIMESTAMP},
+    {"getTimestamp", SIM_MARK_TIMESTAMP, SIM_MARK_PASSWORD},
+    {"keyCheck",     SIM_MARK_PASSWORD,  SIM_MARK_OTP},
+    {"otp",          SIM_MARK_OTP,       SIM_MARK_DONE},
+    {"total",        SIM_MARK_TIMESTAMP, SIM_MARK_DONE},
+};
+static const int phaseCount = sizeof(phases) / sizeof(phases[0]);
+
+static bool readBaseline(const char* path, unsigned long baseline[])
+{
+    FILE* f = fopen(path, "r");
+    if(!f) return false;
+    char name[32];
+    unsigned long cycles;
+    int found = 0;
+    while(fscanf(f, "%31s %lu", name, &cycles) == 2)
+    {
+        for(int i = 0; i < phaseCount; i++)
+        {
+            if(!strcmp(name, phases[i].name))
+            {
+                baseline[i] = cycles;
+                found++;
+            }
+        }
+    }
+    fclose(f);
+    return found == phaseCount;
+}
+
+static void writeBaseline(const char* path, const unsigned long cycles[])
+{
+    FILE* f = fopen(path, "w");
+    if(!f)
+    {
+        perror(path);
+        exit(1);
+    }
+    for(int i = 0; i < phaseCount; i++) fprintf(f, "%s %lu\n", phases[i].name, cycles[i]);
+    fclose(f);
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc < 3)
+    {
+        fprintf(stderr, "usage: %s firmware.elf baseline [--update]\n", argv[0]);
+        return 2;
+    }
+    bool update = argc > 3 && !strcmp(argv[3], "--update");
+
+    elf_firmware_t firmware;
+    memset(&firmware, 0, sizeof(firmware));
+    if(elf_read_firmware(argv[1], &firmware))
+    {
+        fprintf(stderr, "%s: cannot read firmware\n", argv[1]);
+        return 2;
+    }
+
+    avr_t* avr = avr_make_mcu_by_name("attiny85");
+    if(!avr) return 2;
+    avr_init(avr);
+    avr->frequency = 16500000;
+    avr_load_firmware(avr, &firmware);
+
+    HMAC_SHA1_Midstate key;
+    HMAC_SHA1::midstate((const uint8_t*)secret, strlen(secret), key);
+    uint8_t eeprom[sizeof(key) + 2];
+    memcpy(eeprom, &key, sizeof(key));
+    eeprom[sizeof(key)] = 6;
+    eeprom[sizeof(key) + 1] = 30;
+    avr_eeprom_desc_t ee;
+    ee.ee = eeprom;
+    ee.offset = 0;
+    ee.size = sizeof(eeprom);
+    avr_ioctl(avr, AVR_IOCTL_EEPROM_SET, &ee);
+
+    memset(&bus, 0, sizeof(bus));
+    bus.avr = avr;
+    bus.slaveSda = true;
+    bus.sdaLine = true;
+    memcpy(bus.registers, rtcTime, sizeof(rtcTime));
+    bus.scl = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), IOPORT_IRQ_PIN0 + SCL_BIT);
+    bus.sda = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), IOPORT_IRQ_PIN0 + SDA_BIT);
+    avr_irq_register_notify(bus.scl, pinChanged, NULL);
+    avr_irq_register_notify(bus.sda, pinChanged, NULL);
+    avr_register_io_write(avr, USICR_ADDR, usicrWrite, NULL);
+    avr_register_io_write(avr, USISR_ADDR, usisrWrite, NULL);
+    avr_register_io_write(avr, USIDR_ADDR, usidrWrite, NULL);
+    avr_register_io_write(avr, GPIOR0_ADDR, markWrite, NULL);
+    avr_register_io_write(avr, GPIOR1_ADDR, outputWrite, NULL);
+
+    int state = cpu_Running;
+    while(state != cpu_Done && state != cpu_Crashed) state = avr_run(avr);
+
+    if(state == cpu_Crashed || !marks.cycle[SIM_MARK_DONE])
+    {
+        fprintf(stderr, "firmware did not finish\n");
+        return 1;
+    }
+
+    uint8_t counter[8] = {0};
+    uint32_t step = rtcEpoch / 30;
+    for(uint8_t i = 0; i < 4; i++) counter[4 + i] = step >> (24 - 8 * i);
+    uint8_t expected[7] = {0};
+    otp(expected, key, counter);
+
+    int failed = 0;
+    printf("password %s, expected %s, %u RTC transactions\n", marks.password, (const char*)expected, bus.transactions);
+    if(memcmp(marks.password, expected, 6))
+    {
+        printf("FAIL: wrong password\n");
+        failed = 1;
+    }
+
+    unsigned long cycles[phaseCount];
+    unsigned long baseline[phaseCount];
+    bool haveBaseline = !update && readBaseline(argv[2], baseline);
+    if(!update && !haveBaseline)
+    {
+        printf("FAIL: no baseline in %s, record one with --update\n", argv[2]);
+        failed = 1;
+    }
+    for(int i = 0; i < phaseCount; i++)
+    {
+        cycles[i] = marks.cycle[phases[i].to] - marks.cycle[phases[i].from];
+        printf("%-14s %10lu cycles %8.3f ms", phases[i].name, cycles[i], cycles[i] * 1000.0 / avr->frequency);
+        if(haveBaseline)
+        {
+            printf("   baseline %10lu", baseline[i]);
+            if(cycles[i] > baseline[i] + baseline[i] / 100)
+            {
+                printf("  REGRESSION");
+                failed = 1;
+            }
+        }
+        printf("\n");
+    }
+
+    if(update && !failed)
+    {
+        writeBaseline(argv[2], cycles);
+        printf("baseline written to %s\n", argv[2]);
+    }
+
+    return failed;
+}
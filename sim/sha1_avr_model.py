@@ -0,0 +1,295 @@
+#
+#  An implementation of the RFC 6238 time based OTP protocol on an AtTiny85 microcontroller
+#
+#  Copyright (C) 2017 Adam Reid
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 2 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License along
+#  with this program; if not, write to the Free Software Foundation, Inc.,
+#  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+#
+
+# Runs sha1_avr.S, after the C preprocessor, on a small model of the ATtiny85
+# that knows only the instructions the file uses, their ATtiny85 cycle counts
+# and the gas macros it needs. It checks the digests against hashlib and
+# random blocks against the SHA1 rounds, that the avr-gcc call saved registers
+# and r1 survive, and prints the cycles and stack per block.
+#
+# This is no substitute for avr-as and simavr: the model can't tell whether
+# the assembler accepts the file, and it shares its reading of the instruction
+# set with whoever wrote the assembly. make sim-bench SHA1_ASM=1 is the real check.
+#
+#   make sha1-asm-model
+
+import hashlib
+import random
+import re
+import struct
+import sys
+
+def expr(e):
+    return eval(e, {
+        'lo8': lambda x: x & 0xff,
+        'hi8': lambda x: (x >> 8) & 0xff,
+        'hlo8': lambda x: (x >> 16) & 0xff,
+        'hhi8': lambda x: (x >> 24) & 0xff})
+
+def block(lines, i, end):
+    body = []
+    while not lines[i].strip().startswith(end):
+        body.append(lines[i])
+        i += 1
+    return body, i + 1
+
+def substitute(lines, args):
+    out = []
+    for l in lines:
+        for name in sorted(args, key=len, reverse=True):
+            l = l.replace('\\' + name, args[name])
+        out.append(l)
+    return out
+
+def expand(lines, macros):
+    out = []
+    i = 0
+    while i < len(lines):
+        line = lines[i].strip()
+        i += 1
+        if not line:
+            continue
+        if line.startswith('.macro'):
+            name, _, params = line[6:].strip().partition(' ')
+            body, i = block(lines, i, '.endm')
+            macros[name] = ([p.strip() for p in params.split(',') if p.strip()], body)
+        elif line.startswith('.irp'):
+            var, _, values = line[4:].partition(',')
+            body, i = block(lines, i, '.endr')
+            for v in values.split(','):
+                out += expand(substitute(body, {var.strip(): v.strip()}), macros)
+        elif line.startswith('.if '):
+            body, i = block(lines, i, '.endif')
+            if expr(line[4:]):
+                out += expand(body, macros)
+        elif line.split()[0] in macros:
+            params, body = macros[line.split()[0]]
+            args = [a.strip() for a in line[len(line.split()[0]):].split(',')]
+            out += expand(substitute(body, dict(zip(params, args))), macros)
+        else:
+            out.append(line)
+    return out
+
+def assemble(lines):
+    program = []
+    labels = {}
+    for l in lines:
+        m = re.match(r'^(\w+):\s*(.*)$', l)
+        if m:
+            labels[m.group(1)] = len(program)
+            l = m.group(2)
+        if l and not l.startswith('.'):
+            op, _, args = l.partition(' ')
+            program.append((op, [a.strip() for a in args.split(',') if a.strip()]))
+    return program, labels
+
+class AVR:
+    RAMEND = 0x25f
+
+    def __init__(self, program, labels):
+        self.program = program
+        self.labels = labels
+        self.r = [0] * 32
+        self.mem = bytearray(self.RAMEND + 1)
+        self.sp = self.RAMEND
+        self.c = self.z = self.t = 0
+        self.cycles = 0
+
+    def reg(self, a, upper=False):
+        n = int(re.match(r'^r(\d+)$', a).group(1))
+        assert not upper or n >= 16, a
+        return n
+
+    def zaddr(self, a):
+        m = re.match(r'^Z(\+(\d*))?$', a)
+        z = self.r[30] | self.r[31] << 8
+        return z + int(m.group(2) or 0), m.group(1) == '+'
+
+    def bumpz(self):
+        z = (self.r[30] | self.r[31] << 8) + 1
+        self.r[30], self.r[31] = z & 0xff, z >> 8
+
+    def push(self, v):
+        self.mem[self.sp] = v
+        self.sp -= 1
+
+    def pop(self):
+        self.sp += 1
+        return self.mem[self.sp]
+
+    # Runs the function at label until it returns, gives the stack it used
+    # including the return address
+    def call(self, label):
+        self.push(0xff)
+        self.push(0xff)
+        low = self.sp
+        pc = self.labels[label]
+        while True:
+            op, a = self.program[pc]
+            pc += 1
+            self.cycles += 1
+            r = self.r
+            if op in ('add', 'adc'):
+                d = self.reg(a[0])
+                s = r[d] + r[self.reg(a[1])] + (self.c if op == 'adc' else 0)
+                self.c, r[d] = s >> 8, s & 0xff
+                self.z = r[d] == 0
+            elif op in ('subi', 'sbci'):
+                d = self.reg(a[0], True)
+                s = r[d] - (expr(a[1]) & 0xff) - (self.c if op == 'sbci' else 0)
+                self.c, r[d] = int(s < 0), s & 0xff
+            elif op == 'andi':
+                d = self.reg(a[0], True)
+                r[d] &= expr(a[1]) & 0xff
+            elif op == 'ldi':
+                r[self.reg(a[0], True)] = expr(a[1]) & 0xff
+            elif op in ('and', 'eor', 'mov'):
+                d, s = self.reg(a[0]), r[self.reg(a[1])]
+                r[d] = r[d] & s if op == 'and' else r[d] ^ s if op == 'eor' else s
+                if op != 'mov':
+                    self.z = r[d] == 0
+            elif op == 'movw':
+                d, s = self.reg(a[0]), self.reg(a[1])
+                assert d % 2 == 0 and s % 2 == 0, a
+                r[d], r[d + 1] = r[s], r[s + 1]
+            elif op == 'clr':
+                r[self.reg(a[0])] = 0
+            elif op == 'dec':
+                d = self.reg(a[0])
+                r[d] = (r[d] - 1) & 0xff
+                self.z = r[d] == 0
+            elif op in ('lsl', 'rol'):
+                d = self.reg(a[0])
+                carry = self.c if op == 'rol' else 0
+                self.c, r[d] = r[d] >> 7, (r[d] << 1 | carry) & 0xff
+            elif op in ('lsr', 'ror'):
+                d = self.reg(a[0])
+                carry = self.c if op == 'ror' else 0
+                self.c, r[d] = r[d] & 1, r[d] >> 1 | carry << 7
+            elif op == 'bst':
+                self.t = r[self.reg(a[0])] >> int(a[1]) & 1
+            elif op == 'bld':
+                d, b = self.reg(a[0]), int(a[1])
+                r[d] = r[d] & ~(1 << b) | self.t << b
+            elif op in ('ld', 'ldd'):
+                addr, post = self.zaddr(a[1])
+                r[self.reg(a[0])] = self.mem[addr]
+                if post and op == 'ld':
+                    self.bumpz()
+                self.cycles += 1
+            elif op in ('st', 'std'):
+                addr, post = self.zaddr(a[0])
+                self.mem[addr] = r[self.reg(a[1])]
+                if post and op == 'st':
+                    self.bumpz()
+                self.cycles += 1
+            elif op == 'push':
+                self.push(r[self.reg(a[0])])
+                self.cycles += 1
+            elif op == 'pop':
+                r[self.reg(a[0])] = self.pop()
+                self.cycles += 1
+            elif op == 'brne':
+                if not self.z:
+                    pc = self.labels[a[0]]
+                    self.cycles += 1
+            elif op == 'rjmp':
+                pc = self.labels[a[0]]
+                self.cycles += 1
+            elif op == 'rcall':
+                self.push(pc & 0xff)
+                self.push(pc >> 8)
+                pc = self.labels[a[0]]
+                self.cycles += 2
+            elif op == 'ret':
+                pc = self.pop() << 8
+                pc |= self.pop()
+                self.cycles += 3
+                if pc == 0xffff:
+                    return self.RAMEND - low
+            else:
+                raise ValueError('instruction not modelled: ' + op)
+            low = min(low, self.sp)
+
+K = (0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6)
+
+def rol(x, n):
+    return (x << n | x >> (32 - n)) & 0xffffffff
+
+def rounds(h, w):
+    w = list(w)
+    for t in range(16, 80):
+        w.append(rol(w[t - 3] ^ w[t - 8] ^ w[t - 14] ^ w[t - 16], 1))
+    a, b, c, d, e = h
+    for t in range(80):
+        if t < 20:
+            f = d ^ (b & (c ^ d))
+        elif t < 40 or t >= 60:
+            f = b ^ c ^ d
+        else:
+            f = (b & c) | (b & d) | (c & d)
+        a, b, c, d, e = (rol(a, 5) + f + e + K[t // 20] + w[t]) & 0xffffffff, a, rol(b, 30), c, d
+    return [(x + y) & 0xffffffff for x, y in zip(h, (a, b, c, d, e))]
+
+HASH = 0x100
+W = 0x120
+SAVED = list(range(2, 18)) + [28, 29]
+
+def compress(avr, h, w):
+    struct.pack_into('<5I', avr.mem, HASH, *h)
+    struct.pack_into('<16I', avr.mem, W, *w)
+    avr.r = [random.randrange(256) for _ in range(32)]
+    avr.r[1] = 0
+    avr.r[24], avr.r[25] = HASH & 0xff, HASH >> 8
+    avr.r[22], avr.r[23] = W & 0xff, W >> 8
+    saved = [avr.r[i] for i in SAVED]
+    avr.cycles = 0
+    stack = avr.call('sha1_compress_avr')
+    assert [avr.r[i] for i in SAVED] == saved, 'call saved register changed'
+    assert avr.r[1] == 0, 'r1 is not zero'
+    assert avr.sp == avr.RAMEND, 'stack not balanced'
+    return list(struct.unpack_from('<5I', avr.mem, HASH)), avr.cycles, stack
+
+def sha1(avr, msg):
+    h = [0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0]
+    padded = msg + b'\x80' + b'\0' * ((55 - len(msg)) % 64) + struct.pack('>Q', len(msg) * 8)
+    for i in range(0, len(padded), 64):
+        h, cycles, stack = compress(avr, h, struct.unpack('>16I', padded[i:i + 64]))
+    return struct.pack('>5I', *h), cycles, stack
+
+def main():
+    program, labels = assemble(expand(sys.stdin.read().split('\n'), {}))
+    avr = AVR(program, labels)
+    random.seed(1)
+    for msg in (b'', b'abc', b'abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq', b'a' * 1000):
+        digest, cycles, stack = sha1(avr, msg)
+        if digest != hashlib.sha1(msg).digest():
+            print('FAIL: SHA1 of %d bytes is %s' % (len(msg), digest.hex()))
+            return 1
+    for n in range(1000):
+        h = [random.getrandbits(32) for _ in range(5)]
+        w = [random.getrandbits(32) for _ in range(16)]
+        if compress(avr, h, w)[0] != rounds(h, w):
+            print('FAIL: random block %d' % n)
+            return 1
+    print('sha1_compress_avr: %d instructions, %d cycles and %d bytes of stack per block' % (len(program), cycles, stack))
+    return 0
+
+sys.exit(main())
@@ -80,7 +80,7 @@ def setTime():
     device.ctrl_transfer(0x20, 0x9, 0x2, 0, b)
 
 def setSecret(secret):
-    """Set the secret on the device
+    """Set the secret of the active slot, with 6 digits and 30 second steps
     
     Args:
         secret (str): a base32 encoded string containing the secret.
@@ -93,3 +93,69 @@ def setSecret(secret):
     device = connect()
     device.ctrl_transfer(0x20, 0x9, 0x3, 0, b)
 
+def setSlot(slot, secret, label='', digits=6, period=30):
+    """Store a secret in one of the device's slots
+
+    Args:
+        slot (int): slot number, 0 to the slot count from getSlot() - 1
+        secret (str): base32 encoded secret, as for setSecret()
+        label (str): name of the service, up to 16 characters
+        digits (int): code length, 6 to 8
+        period (int): time step in seconds, 1 to 254
+    """
+    k = list(base64.b32decode(secret.upper().replace(' ','')))
+    if len(k) > 40: raise ValueError
+    l = list(bytearray(label.encode('utf-8')))
+    if len(l) > 16 or not 6 <= digits <= 8 or not 1 <= period <= 254: raise ValueError
+    d = [4, slot, digits, period] + l + ([0] * (16-len(l))) + [len(k)] + k + ([0] * (40-len(k)))
+    device = connect()
+    device.ctrl_transfer(0x20, 0x9, 0x4, 0, bytes(bytearray(d)))
+
+def selectSlot(slot):
+    """Make a slot the one used when the button is pressed
+
+    Args:
+        slot (int): slot number
+    """
+    d = [5, slot] + ([0] * 19)
+    device = connect()
+    device.ctrl_transfer(0x20, 0x9, 0x5, 0, bytes(bytearray(d)))
+
+def getSlot():
+    """Get the active slot
+
+    Returns: a dict with the active slot number, the number of slots and the
+        label, digits and period of the active slot
+    """
+    device = connect()
+    ba = device.ctrl_transfer(0x80 | 0x20, 0x1, 0x5, 0, 21)
+    label = bytes(bytearray(ba[5:21])).split(b'\0')[0].decode('utf-8', 'replace')
+    return {'slot': ba[1], 'count': ba[2], 'digits': ba[3], 'period': ba[4], 'label': label}
+
+def setTyping(interval=10, gap=0, enter=False, release=False):
+    """Set how the code is typed, stored on the device
+
+    Changing the interval makes the device reconnect so the host picks it up.
+    When up to six held keys could stay down more than 200 ms, the device
+    releases every key whatever release says, so the host doesn't repeat it.
+
+    Args:
+        interval (int): keyboard poll interval in ms, 10 to 200
+        gap (int): extra ms between keyboard reports, 0 to 254
+        enter (bool): press Enter after the code
+        release (bool): release every key before the next one, for hosts that
+            drop keys while another is held
+    """
+    if not 10 <= interval <= 200 or not 0 <= gap <= 254: raise ValueError
+    d = [6, interval, gap, (1 if enter else 0) | (2 if release else 0)]
+    device = connect()
+    device.ctrl_transfer(0x20, 0x9, 0x6, 0, bytes(bytearray(d)))
+
+def getTyping():
+    """Get the typing settings
+
+    Returns: a dict with the interval, gap, enter and release settings of setTyping()
+    """
+    device = connect()
+    ba = device.ctrl_transfer(0x80 | 0x20, 0x1, 0x6, 0, 4)
+    return {'interval': ba[1], 'gap': ba[2], 'enter': bool(ba[3] & 1), 'release': bool(ba[3] & 2)}
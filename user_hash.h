@@ -0,0 +1,45 @@
+/*
+
+An implementation of the RFC 6238 time based OTP protocol on an AtTiny85 microcontroller
+
+Copyright (C) 2017 Adam Reid
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+
+#ifndef _USER_HASH_H_
+#define _USER_HASH_H_
+
+#include <stdint.h>
+
+/*
+Hash of a user ID for the per user tables of the verification service,
+OTP_ReplayCache and OTP_DriftTable. It is the murmur3 64 bit finaliser, a
+different mix to the secret database, so users that share a database probe
+sequence don't also share a replay bucket or drift entry.
+*/
+
+static inline uint64_t userHash(uint64_t user)
+{
+    user ^= user >> 33;
+    user *= 0xff51afd7ed558ccdull;
+    user ^= user >> 33;
+    user *= 0xc4ceb9fe1a85ec53ull;
+    return user ^ (user >> 33);
+}
+
+#endif
@@ -28,10 +28,16 @@
 ****************************************************************************/
 #include <avr/io.h>
 #include "usi_twi_master.h"
-#include <util/delay.h>
+#include <avr/interrupt.h>
+
+// T2_TWI and T4_TWI are CPU cycles, derived from F_CPU in usi_twi_master.h
+#define TWI_DELAY( cycles ) __builtin_avr_delay_cycles( (unsigned long)(cycles) )
 
 unsigned char USI_TWI_Master_Transfer( unsigned char );
 unsigned char USI_TWI_Master_Stop( void );
+unsigned char USI_TWI_Master_Transceive( unsigned char * , unsigned char , unsigned char );
+void          USI_TWI_Master_Start( void );
+unsigned char USI_TWI_Master_Byte( unsigned char * , unsigned char );
 
 union  USI_TWI_state
 {
@@ -85,11 +91,32 @@ unsigned char USI_TWI_Get_State_Info( void )
 ---------------------------------------------------------------*/
 unsigned char USI_TWI_Start_Transceiver_With_Data( unsigned char *msg, unsigned char msgSize)
 {
-  unsigned char tempUSISR_8bit = (1<<USISIF)|(1<<USIOIF)|(1<<USIPF)|(1<<USIDC)|      // Prepare register value to: Clear flags, and
-                                 (0x0<<USICNT0);                                     // set USI to shift 8 bits i.e. count 16 clock edges.
-  unsigned char tempUSISR_1bit = (1<<USISIF)|(1<<USIOIF)|(1<<USIPF)|(1<<USIDC)|      // Prepare register value to: Clear flags, and
-                                 (0xE<<USICNT0);                                     // set USI to shift 1 bit i.e. count 2 clock edges.
+  return USI_TWI_Master_Transceive( msg, msgSize, TRUE );
+}
 
+/*---------------------------------------------------------------
+ Write then read in one bus transaction. msg[0] is the address
+ byte for the write and msg[1..writeSize-1] the data written.
+ A Repeated Start follows and readSize bytes are read into
+ msg[writeSize..]. msg[writeSize-1] is overwritten with the read
+ address byte.
+---------------------------------------------------------------*/
+unsigned char USI_TWI_Start_Combined( unsigned char *msg, unsigned char writeSize, unsigned char readSize )
+{
+  unsigned char address = *msg;
+
+  if( !USI_TWI_Master_Transceive( msg, writeSize, FALSE ) ) return (FALSE);
+  msg += writeSize - 1;
+  *msg = address | (1<<TWI_READ_BIT);
+  return USI_TWI_Master_Transceive( msg, readSize + 1, TRUE );
+}
+
+/*---------------------------------------------------------------
+ Transfer for the two functions above. The STOP condition is left
+ out when stop is FALSE so that a Repeated Start can follow.
+---------------------------------------------------------------*/
+unsigned char USI_TWI_Master_Transceive( unsigned char *msg, unsigned char msgSize, unsigned char stop )
+{
   USI_TWI_state.errorState = 0;
   USI_TWI_state.addressMode = TRUE;
 
@@ -129,75 +156,101 @@ unsigned char USI_TWI_Start_Transceiver_With_Data( unsigned char *msg, unsigned
     USI_TWI_state.masterWriteDataMode = TRUE;
   }
 
+  USI_TWI_Master_Start();
+
+#ifdef SIGNAL_VERIFY
+  if( !(USISR & (1<<USISIF)) )
+  {
+    USI_TWI_state.errorState = USI_TWI_MISSING_START_CON;  
+    return (FALSE);
+  }
+#endif
+
+/*Write address and Read/Write data */
+  do
+  {
+    if( !USI_TWI_Master_Byte( msg++, msgSize == 1 ) )
+      return (FALSE);
+  }while( --msgSize) ;                             // Until all data sent/received.
+  
+  if( stop )
+    USI_TWI_Master_Stop();                         // Send a STOP condition on the TWI bus.
+
+/* Transmission successfully completed*/
+  return (TRUE);
+}
+
+/*---------------------------------------------------------------
+ Generate a (Repeated) Start Condition.
+---------------------------------------------------------------*/
+void USI_TWI_Master_Start( void )
+{
 /* Release SCL to ensure that (repeated) Start can be performed */
   PORT_USI |= (1<<PIN_USI_SCL);                     // Release SCL.
   while( !(PIN_USI & (1<<PIN_USI_SCL)) );          // Verify that SCL becomes high.
 #ifdef TWI_FAST_MODE
-  _delay_us( T4_TWI/4 );                         // Delay for T4TWI if TWI_FAST_MODE
+  TWI_DELAY( T4_TWI );                              // Delay for T4TWI if TWI_FAST_MODE
 #else
-  _delay_us( T2_TWI/4 );                         // Delay for T2TWI if TWI_STANDARD_MODE
+  TWI_DELAY( T2_TWI );                              // Delay for T2TWI if TWI_STANDARD_MODE
 #endif
 
 /* Generate Start Condition */
   PORT_USI &= ~(1<<PIN_USI_SDA);                    // Force SDA LOW.
-  _delay_us( T4_TWI/4 );                         
+  TWI_DELAY( T4_TWI );
   PORT_USI &= ~(1<<PIN_USI_SCL);                    // Pull SCL LOW.
   PORT_USI |= (1<<PIN_USI_SDA);                     // Release SDA.
+}
 
-#ifdef SIGNAL_VERIFY
-  if( !(USISR & (1<<USISIF)) )
+/*---------------------------------------------------------------
+ Write or read one byte and its (N)ACK. last is TRUE for the last
+ byte of a read, which is answered with a NACK. Returns FALSE and
+ sets the error state if the slave does not acknowledge a write.
+---------------------------------------------------------------*/
+unsigned char USI_TWI_Master_Byte( unsigned char *msg, unsigned char last )
+{
+  unsigned char tempUSISR_8bit = (1<<USISIF)|(1<<USIOIF)|(1<<USIPF)|(1<<USIDC)|      // Prepare register value to: Clear flags, and
+                                 (0x0<<USICNT0);                                     // set USI to shift 8 bits i.e. count 16 clock edges.
+  unsigned char tempUSISR_1bit = (1<<USISIF)|(1<<USIOIF)|(1<<USIPF)|(1<<USIDC)|      // Prepare register value to: Clear flags, and
+                                 (0xE<<USICNT0);                                     // set USI to shift 1 bit i.e. count 2 clock edges.
+
+  /* If masterWrite cycle (or inital address tranmission)*/
+  if (USI_TWI_state.addressMode || USI_TWI_state.masterWriteDataMode)
   {
-    USI_TWI_state.errorState = USI_TWI_MISSING_START_CON;  
-    return (FALSE);
+    /* Write a byte */
+    PORT_USI &= ~(1<<PIN_USI_SCL);                  // Pull SCL LOW.
+    USIDR     = *msg;                               // Setup data.
+    USI_TWI_Master_Transfer( tempUSISR_8bit );      // Send 8 bits on bus.
+    
+    /* Clock and verify (N)ACK from slave */
+    DDR_USI  &= ~(1<<PIN_USI_SDA);                  // Enable SDA as input.
+    if( USI_TWI_Master_Transfer( tempUSISR_1bit ) & (1<<TWI_NACK_BIT) ) 
+    {
+      if ( USI_TWI_state.addressMode )
+        USI_TWI_state.errorState = USI_TWI_NO_ACK_ON_ADDRESS;
+      else
+        USI_TWI_state.errorState = USI_TWI_NO_ACK_ON_DATA;
+      return (FALSE);
+    }
+    USI_TWI_state.addressMode = FALSE;              // Only perform address transmission once.
   }
-#endif
-
-/*Write address and Read/Write data */
-  do
+  /* Else masterRead cycle*/
+  else
   {
-    /* If masterWrite cycle (or inital address tranmission)*/
-    if (USI_TWI_state.addressMode || USI_TWI_state.masterWriteDataMode)
+    /* Read a data byte */
+    DDR_USI   &= ~(1<<PIN_USI_SDA);                 // Enable SDA as input.
+    *msg       = USI_TWI_Master_Transfer( tempUSISR_8bit );
+
+    /* Prepare to generate ACK (or NACK in case of End Of Transmission) */
+    if( last )                                      // If transmission of last byte was performed.
     {
-      /* Write a byte */
-      PORT_USI &= ~(1<<PIN_USI_SCL);                // Pull SCL LOW.
-      USIDR     = *(msg++);                        // Setup data.
-      USI_TWI_Master_Transfer( tempUSISR_8bit );    // Send 8 bits on bus.
-      
-      /* Clock and verify (N)ACK from slave */
-      DDR_USI  &= ~(1<<PIN_USI_SDA);                // Enable SDA as input.
-      if( USI_TWI_Master_Transfer( tempUSISR_1bit ) & (1<<TWI_NACK_BIT) ) 
-      {
-        if ( USI_TWI_state.addressMode )
-          USI_TWI_state.errorState = USI_TWI_NO_ACK_ON_ADDRESS;
-        else
-          USI_TWI_state.errorState = USI_TWI_NO_ACK_ON_DATA;
-        return (FALSE);
-      }
-      USI_TWI_state.addressMode = FALSE;            // Only perform address transmission once.
+      USIDR = 0xFF;                                 // Load NACK to confirm End Of Transmission.
     }
-    /* Else masterRead cycle*/
     else
     {
-      /* Read a data byte */
-      DDR_USI   &= ~(1<<PIN_USI_SDA);               // Enable SDA as input.
-      *(msg++)  = USI_TWI_Master_Transfer( tempUSISR_8bit );
-
-      /* Prepare to generate ACK (or NACK in case of End Of Transmission) */
-      if( msgSize == 1)                            // If transmission of last byte was performed.
-      {
-        USIDR = 0xFF;                              // Load NACK to confirm End Of Transmission.
-      }
-      else
-      {
-        USIDR = 0x00;                              // Load ACK. Set data register bit 7 (output for SDA) low.
-      }
-      USI_TWI_Master_Transfer( tempUSISR_1bit );   // Generate ACK/NACK.
+      USIDR = 0x00;                                 // Load ACK. Set data register bit 7 (output for SDA) low.
     }
-  }while( --msgSize) ;                             // Until all data sent/received.
-  
-  USI_TWI_Master_Stop();                           // Send a STOP condition on the TWI bus.
-
-/* Transmission successfully completed*/
+    USI_TWI_Master_Transfer( tempUSISR_1bit );     // Generate ACK/NACK.
+  }
   return (TRUE);
 }
 
@@ -216,14 +269,14 @@ unsigned char USI_TWI_Master_Transfer( unsigned char temp )
            (1<<USITC);                              // Toggle Clock Port.
   do
   {
-    _delay_us( T2_TWI/4 );              
+    TWI_DELAY( T2_TWI );              
     USICR = temp;                          // Generate positve SCL edge.
     while( !(PIN_USI & (1<<PIN_USI_SCL)) );// Wait for SCL to go high.
-    _delay_us( T4_TWI/4 );              
+    TWI_DELAY( T4_TWI );              
     USICR = temp;                          // Generate negative SCL edge.
   }while( !(USISR & (1<<USIOIF)) );        // Check for transfer complete.
   
-  _delay_us( T2_TWI/4 );                
+  TWI_DELAY( T2_TWI );                
   temp  = USIDR;                           // Read out data.
   USIDR = 0xFF;                            // Release SDA.
   DDR_USI |= (1<<PIN_USI_SDA);             // Enable SDA as output.
@@ -240,9 +293,9 @@ unsigned char USI_TWI_Master_Stop( void )
   PORT_USI &= ~(1<<PIN_USI_SDA);           // Pull SDA low.
   PORT_USI |= (1<<PIN_USI_SCL);            // Release SCL.
   while( !(PIN_USI & (1<<PIN_USI_SCL)) );  // Wait for SCL to go high.
-  _delay_us( T4_TWI/4 );               
+  TWI_DELAY( T4_TWI );               
   PORT_USI |= (1<<PIN_USI_SDA);            // Release SDA.
-  _delay_us( T2_TWI/4 );                
+  TWI_DELAY( T2_TWI );                
   
 #ifdef SIGNAL_VERIFY
   if( !(USISR & (1<<USIPF)) )
@@ -254,3 +307,147 @@ unsigned char USI_TWI_Master_Stop( void )
 
   return (TRUE);
 }
+
+/*---------------------------------------------------------------
+ Interrupt driven transfers. Each Timer0 compare match runs one
+ step, a Start Condition, one byte with its (N)ACK or the Stop
+ Condition, using the same code and bus timing as the blocking
+ functions. The handler runs with interrupts enabled so USB is
+ still serviced. It masks the compare interrupt while a step runs,
+ so the ~10us tick doesn't keep entering it, and restarts the timer
+ when the step ends so the main loop gets TWI_ASYNC_TICK between
+ steps.
+ Timer0 registers are as named on the ATtiny25/45/85.
+
+ Why Timer0 and not the USI start and overflow interrupts: as a
+ two wire master the USI only moves SCL when software writes
+ USITC, the Timer0 clock source shifts USIDR without driving the
+ pin. An engine run by the overflow interrupt would still need an
+ interrupt for every SCL edge, 18 per byte, one every 5us in
+ standard mode. That is about 80 cycles at 16.5MHz, half of them
+ spent in the prologue and epilogue, and it would compete with
+ the V-USB interrupt. The start condition interrupt only matters
+ to a slave.
+
+ What this costs instead: a step busy waits through the bus
+ timing. A byte step is about 90us (1500 cycles) in standard
+ mode and 25us in fast mode. The DS1307 read in main.cpp (start,
+ two written bytes, repeated start, address and 8 read bytes,
+ stop) keeps the CPU for about 1.0ms (0.28ms fast), once a
+ second, 0.1% of the CPU. The main loop stalls for up to one
+ step at a time, and USB interrupts are still serviced.
+---------------------------------------------------------------*/
+#define TWI_PHASE_IDLE      0
+#define TWI_PHASE_START     1                       // Generate (Repeated) Start Condition
+#define TWI_PHASE_BYTE      2                       // Write or read a byte
+#define TWI_PHASE_STOP      3                       // Generate Stop Condition
+
+static unsigned char *asyncMsg;
+static unsigned char asyncSize;
+static unsigned char asyncReadSize;                 // Bytes to read after a Repeated Start
+static unsigned char asyncAddress;
+static unsigned char asyncFailed;
+static volatile unsigned char asyncPhase = TWI_PHASE_IDLE;
+static volatile unsigned char asyncResult = USI_TWI_ASYNC_DONE;
+static volatile unsigned char asyncStepping;
+
+ISR( TIMER0_COMPA_vect, ISR_NOBLOCK )
+{
+  if( asyncStepping ) return;                       // A match that was pending as the prologue enabled interrupts.
+  asyncStepping = TRUE;
+  TIMSK &= ~(1<<OCIE0A);                            // No more matches until this step is done.
+
+  switch( asyncPhase )
+  {
+    case TWI_PHASE_START:
+      USI_TWI_Master_Start();
+      asyncPhase = TWI_PHASE_BYTE;
+      break;
+
+    case TWI_PHASE_BYTE:
+      if( !USI_TWI_Master_Byte( asyncMsg++, asyncSize == 1 ) )
+      {
+        asyncFailed = TRUE;
+        asyncPhase  = TWI_PHASE_STOP;
+      }
+      else if( !--asyncSize )                       // All data sent/received.
+      {
+        if( asyncReadSize )                         // Combined transfer, read after a Repeated Start.
+        {
+          *(--asyncMsg) = asyncAddress | (1<<TWI_READ_BIT);
+          asyncSize     = asyncReadSize + 1;
+          asyncReadSize = 0;
+          USI_TWI_state.addressMode         = TRUE;
+          USI_TWI_state.masterWriteDataMode = FALSE;
+          asyncPhase = TWI_PHASE_START;
+        }
+        else asyncPhase = TWI_PHASE_STOP;
+      }
+      break;
+
+    case TWI_PHASE_STOP:
+      USI_TWI_Master_Stop();
+      TCCR0B  = 0;                                  // Stop the step timer.
+      asyncResult = asyncFailed ? USI_TWI_ASYNC_FAIL : USI_TWI_ASYNC_DONE;
+      asyncPhase  = TWI_PHASE_IDLE;
+      break;
+  }
+
+  if( asyncPhase != TWI_PHASE_IDLE )
+  {
+    TCNT0  = 0;                                     // Next step one tick after this one ends.
+    TIFR   = (1<<OCF0A);
+    TIMSK |= (1<<OCIE0A);
+  }
+  asyncStepping = FALSE;
+}
+
+/*---------------------------------------------------------------
+ Start a transfer in the background. The message format is the
+ same as for USI_TWI_Start_Combined(), with readSize 0 it is a
+ plain USI_TWI_Start_Transceiver_With_Data() transfer. Returns
+ FALSE if a transfer is already in progress.
+---------------------------------------------------------------*/
+unsigned char USI_TWI_Start_Combined_Async( unsigned char *msg, unsigned char writeSize, unsigned char readSize )
+{
+  if( asyncPhase != TWI_PHASE_IDLE ) return (FALSE);
+
+  USI_TWI_state.errorState  = 0;
+  USI_TWI_state.addressMode = TRUE;
+  if ( !(*msg & (1<<TWI_READ_BIT)) )
+  {
+    USI_TWI_state.masterWriteDataMode = TRUE;
+  }
+
+  asyncMsg      = msg;
+  asyncSize     = writeSize;
+  asyncReadSize = readSize;
+  asyncAddress  = *msg;
+  asyncFailed   = FALSE;
+  asyncResult   = USI_TWI_ASYNC_BUSY;
+  asyncPhase    = TWI_PHASE_START;
+
+  TCCR0A  = (1<<WGM01);                             // CTC mode.
+  OCR0A   = TWI_ASYNC_TICK;
+  TCNT0   = 0;
+  TIFR    = (1<<OCF0A);
+  TIMSK  |= (1<<OCIE0A);
+  TCCR0B  = (1<<CS01);                              // CK/8.
+
+  return (TRUE);
+}
+
+unsigned char USI_TWI_Start_Async( unsigned char *msg, unsigned char msgSize )
+{
+  return USI_TWI_Start_Combined_Async( msg, msgSize, 0 );
+}
+
+/*---------------------------------------------------------------
+ USI_TWI_ASYNC_BUSY while a transfer started with
+ USI_TWI_Start_Async() is running, then USI_TWI_ASYNC_DONE or
+ USI_TWI_ASYNC_FAIL.
+---------------------------------------------------------------*/
+unsigned char USI_TWI_Async_State( void )
+{
+  return ( asyncResult );
+}
@@ -24,6 +24,13 @@
 *                     the USI_TWI_Start_Transceiver_With_Data() function. If the transceiver
 *                     returns with a fail, then use USI_TWI_Get_Status_Info to evaluate the 
 *                     couse of the failure.
+*                     USI_TWI_Start_Combined() writes and then reads after a Repeated
+*                     Start, for example a register pointer followed by the registers.
+*                     USI_TWI_Start_Async() starts the same transfer in the background,
+*                     stepped by the Timer0 compare interrupt, and returns at once
+*                     (USI_TWI_Start_Combined_Async() likewise). Poll
+*                     USI_TWI_Async_State() for completion and leave the buffer alone
+*                     until then.
 *
 ****************************************************************************/
     #include<avr/io.h> 
@@ -32,7 +39,7 @@
 // Defines controlling timing limits
 //#define TWI_FAST_MODE
 
-#define SYS_CLK   16500.0  // [kHz]
+#define SYS_CLK   (F_CPU / 1000.0)  // [kHz]
 
 #ifdef TWI_FAST_MODE               // TWI FAST mode timing limits. SCL = 100-400kHz
   #define T2_TWI    ((SYS_CLK *1300) /1000000) +1 // >1,3us
@@ -43,6 +50,13 @@
   #define T4_TWI    ((SYS_CLK *4000) /1000000) +1 // >4,0us
 #endif
 
+// T2_TWI and T4_TWI are in CPU cycles. Build with -DTWI_FAST_MODE
+// (make TWI_FAST_MODE=1) for the 400kHz timing.
+
+// Timer0 compare value for the interrupt driven transfers. Timer0 counts at
+// CK/8 and the main loop gets this long between bus steps, about 10us.
+#define TWI_ASYNC_TICK  ((SYS_CLK * 10) / 1000 / 8)
+
 // Defines controling code generating
 //#define PARAM_VERIFICATION
 //#define NOISE_TESTING
@@ -106,6 +120,11 @@
     #define PIN_USI_SCL         PINB7
 #endif
 
+// USI_TWI_Async_State() results
+#define USI_TWI_ASYNC_DONE          0x00  // Idle, the last transfer succeeded
+#define USI_TWI_ASYNC_BUSY          0x01  // Transfer in progress
+#define USI_TWI_ASYNC_FAIL          0x02  // Idle, USI_TWI_Get_State_Info() has the error
+
 // General defines
 #define TRUE  1
 #define FALSE 0
@@ -115,3 +134,7 @@
 void              USI_TWI_Master_Initialise( void );
  unsigned char USI_TWI_Start_Transceiver_With_Data( unsigned char * , unsigned char );
 unsigned char USI_TWI_Get_State_Info( void );
+unsigned char USI_TWI_Start_Combined( unsigned char * , unsigned char , unsigned char );
+unsigned char USI_TWI_Start_Async( unsigned char * , unsigned char );
+unsigned char USI_TWI_Start_Combined_Async( unsigned char * , unsigned char , unsigned char );
+unsigned char USI_TWI_Async_State( void );
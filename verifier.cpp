@@ -0,0 +1,144 @@
+/*
+
+An implementation of the RFC 6238 time based OTP protocol on an AtTiny85 microcontroller
+
+Copyright (C) 2017 Adam Reid
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#include "verifier.h"
+#include <string.h>
+
+//The widest engine, its pass takes no longer than a narrower one's. With the
+//SHA extensions two HMACs cost about as much as a pass, so a step or two is
+//quicker one at a time
+OTP_Verifier::OTP_Verifier(const OTP_KeySource& keys, uint8_t window, OTP_ReplayCache* replay, OTP_DriftTable* drift):
+    mKeys(keys), mWindow(window > 127 ? 127 : window), mReplay(replay), mDrift(drift),
+    mFastScalar(SHA1::hardware())
+{
+}
+
+static void stepCode(uint8_t* password, const OTP_Key& k, uint64_t step)
+{
+    uint8_t counter[8];
+    for(uint8_t i = 0; i < 8; i++) counter[i] = step >> (56 - 8 * i);
+    otp(password, k.key, counter, k.digits);
+}
+
+//No early exit, the time taken doesn't depend on how many digits match
+static bool sameCode(const uint8_t* password, const char* code, uint8_t digits)
+{
+    uint8_t diff = 0;
+    for(uint8_t i = 0; i < digits; i++) diff |= password[i] ^ (uint8_t)code[i];
+    return !diff;
+}
+
+OTP_VerifyResult OTP_Verifier::accept(uint64_t user, const OTP_Key& k, uint64_t step, int offset, int recorded, uint64_t time) const
+{
+    if(mReplay && !mReplay->use(user, (step + offset + mWindow + 1) * k.period, time)) return OTP_VERIFY_REPLAY;
+    if(mDrift && offset != recorded) mDrift->set(user, offset);
+    return OTP_VERIFY_OK;
+}
+
+//The step at the token's drift is tried on its own first, as it usually
+//matches. The rest of the window is hashed in one multi-buffer pass, unless it
+//is only a few steps and the scalar engine is fast, and tried in order of
+//distance from the drift, later first on a tie. Steps are never outside the
+//window around the server's step.
+OTP_VerifyResult OTP_Verifier::verify(uint64_t user, const char* code, uint64_t time) const
+{
+    const OTP_Key* k = mKeys.find(user);
+    if(!k) return OTP_VERIFY_UNKNOWN_USER;
+    if(strnlen(code, sizeof(OTP_VerifyRequest::code)) != k->digits) return OTP_VERIFY_BAD_CODE;
+
+    uint64_t step = time / k->period;
+    int window = mWindow;
+    int first = step < (uint64_t)window ? -(int)step : -window;
+    int recorded = mDrift ? mDrift->get(user) : 0;
+    int drift = recorded < first || recorded > window ? 0 : recorded;
+
+    bool tried = mDrift || first == window;
+    if(tried)
+    {
+        uint8_t password[9];
+        stepCode(password, *k, step + drift);
+        if(sameCode(password, code, k->digits)) return accept(user, *k, step, drift, recorded, time);
+        if(first == window) return OTP_VERIFY_BAD_CODE;
+    }
+
+    uint8_t passwords[255 * 9];
+    bool batch = !mFastScalar || window - first + 1 - tried >= 3;
+    if(batch) otpWindow(passwords, k->key, step + first, window - first + 1, k->digits, mMulti);
+    for(int distance = tried ? 1 : 0; distance <= window - first; distance++)
+    {
+        for(int side = 0; side < (distance ? 2 : 1); side++)
+        {
+            int offset = side ? drift - distance : drift + distance;
+            if(offset < first || offset > window) continue;
+            uint8_t* password = &passwords[(offset - first) * k->digits];
+            if(!batch) stepCode(password, *k, step + offset);
+            if(sameCode(password, code, k->digits)) return accept(user, *k, step, offset, recorded, time);
+        }
+    }
+    return OTP_VERIFY_BAD_CODE;
+}
+
+OTP_VerifierPool::OTP_VerifierPool(const OTP_Verifier& verifier, unsigned threads):
+    mVerifier(verifier), mStop(false)
+{
+    if(!threads) threads = std::thread::hardware_concurrency();
+    if(!threads) threads = 1;
+    for(unsigned i = 0; i < threads; i++) mThreads.push_back(std::thread(&OTP_VerifierPool::work, this));
+}
+
+//Finishes the queued batches before the threads exit
+OTP_VerifierPool::~OTP_VerifierPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStop = true;
+    }
+    mReady.notify_all();
+    for(std::thread& t : mThreads) t.join();
+}
+
+void OTP_VerifierPool::submit(const OTP_VerifyRequest* requests, OTP_VerifyResult* results, size_t count, std::function<void()> done)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mQueue.push_back(Batch{requests, results, count, std::move(done)});
+    }
+    mReady.notify_one();
+}
+
+void OTP_VerifierPool::work()
+{
+    for(;;)
+    {
+        Batch b;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mReady.wait(lock, [this]{ return mStop || !mQueue.empty(); });
+            if(mQueue.empty()) return;
+            b = std::move(mQueue.front());
+            mQueue.pop_front();
+        }
+
+        for(size_t i = 0; i < b.count; i++) b.results[i] = mVerifier.verify(b.requests[i]);
+        if(b.done) b.done();
+    }
+}
@@ -0,0 +1,132 @@
+/*
+
+An implementation of the RFC 6238 time based OTP protocol on an AtTiny85 microcontroller
+
+Copyright (C) 2017 Adam Reid
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#ifndef _VERIFIER_H_
+#define _VERIFIER_H_
+
+#include "drift_table.h"
+#include "otp.h"
+#include "replay_cache.h"
+#include "secret_db.h"
+#include "sha1_multi.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+Server side TOTP verification for host builds, using otp() so the server
+computes codes exactly as the token does.
+
+Keys come from an OTP_KeySource, either an OTP_SecretStore in memory or an
+OTP_SecretDB file, see secret_db.h.
+
+OTP_Verifier checks a submitted code against the steps from window before to
+window after the current one. With an OTP_ReplayCache, see replay_cache.h, a
+code that was already accepted is refused. With an OTP_DriftTable, see
+drift_table.h, the step each token last matched at is tried first, so a
+drifting token still usually costs one HMAC. The rest of the window is hashed
+at once with otpWindow(). Measured on an AVX-512 host, a window of two steps
+either side then costs about 1.4 scalar HMACs and one of 16 steps about 2.3,
+against an HMAC per step. time should come from the server clock.
+verify() is thread safe.
+
+OTP_VerifierPool runs verifications on worker threads. Requests are queued in
+batches and done() is called on a worker once a batch is finished.
+
+Usage:
+
+OTP_SecretDB db;
+db.open("tokens.db");
+OTP_ReplayCache used(users);                    //room for a code per user
+OTP_DriftTable drift(users);
+OTP_Verifier verifier(db, 1, &used, &drift);    //accept one step either side
+OTP_VerifyResult r = verifier.verify(user, "123456", time(0));
+
+OTP_VerifierPool pool(verifier);                //one thread per core
+pool.submit(requests, results, n, []{ ... });   //results[i] for requests[i]
+*/
+
+enum OTP_VerifyResult
+{
+    OTP_VERIFY_OK,
+    OTP_VERIFY_BAD_CODE,
+    OTP_VERIFY_UNKNOWN_USER,
+    OTP_VERIFY_REPLAY
+};
+
+//code is the submitted digits, time the Unix time in seconds it was entered
+struct OTP_VerifyRequest
+{
+    uint64_t user;
+    uint64_t time;
+    char code[10];
+};
+
+class OTP_Verifier
+{
+    public:
+    OTP_Verifier(const OTP_KeySource& keys, uint8_t window = 1, OTP_ReplayCache* replay = 0, OTP_DriftTable* drift = 0);
+    OTP_VerifyResult verify(uint64_t user, const char* code, uint64_t time) const;
+    OTP_VerifyResult verify(const OTP_VerifyRequest& request) const { return verify(request.user, request.code, request.time); }
+
+    private:
+    const OTP_KeySource& mKeys;
+    uint8_t mWindow;
+    OTP_ReplayCache* mReplay;
+    OTP_DriftTable* mDrift;
+    SHA1_Multi mMulti;
+    bool mFastScalar;
+
+    OTP_VerifyResult accept(uint64_t user, const OTP_Key& k, uint64_t step, int offset, int recorded, uint64_t time) const;
+};
+
+class OTP_VerifierPool
+{
+    public:
+    OTP_VerifierPool(const OTP_Verifier& verifier, unsigned threads = 0);
+    ~OTP_VerifierPool();
+    unsigned threads() const { return mThreads.size(); }
+    void submit(const OTP_VerifyRequest* requests, OTP_VerifyResult* results, size_t count, std::function<void()> done);
+
+    private:
+    struct Batch
+    {
+        const OTP_VerifyRequest* requests;
+        OTP_VerifyResult* results;
+        size_t count;
+        std::function<void()> done;
+    };
+
+    const OTP_Verifier& mVerifier;
+    std::vector<std::thread> mThreads;
+    std::deque<Batch> mQueue;
+    std::mutex mMutex;
+    std::condition_variable mReady;
+    bool mStop;
+
+    void work();
+};
+
+#endif
@@ -0,0 +1,232 @@
+/*
+
+An implementation of the RFC 6238 time based OTP protocol on an AtTiny85 microcontroller
+
+Copyright (C) 2017 Adam Reid
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+/*
+Load generator for OTP_VerifierPool. Builds a secret store of random users and
+a table of requests with known answers: current codes, codes one step early or
+late, wrong codes and unknown users. The store is written to a temporary
+OTP_SecretDB file, which the verifier maps, and the verifier has a replay cache
+and a drift table. Tokens with codes a step off are found at their drift after
+the first round.
+Producer threads keep batches of requests queued on the pool for a few seconds,
+going round the table many times. Every result is checked against the table,
+where a valid code has to be accepted exactly once and refused as a replay
+after that, and the verification rate is printed.
+
+Build and run with: make verify-bench
+Options: otp-verify-load [worker threads] [producer threads] [seconds] [window]
+*/
+
+#include "verifier.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define USERS 100000
+#define REQUESTS 65536
+#define BATCH 256
+#define BATCHES_IN_FLIGHT 8
+#define TARGET_RATE 100000
+
+typedef std::chrono::steady_clock Clock;
+
+static double milliseconds(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+struct Expected
+{
+    OTP_VerifyRequest request;
+    OTP_VerifyResult result;
+};
+
+//Time of all requests, any fixed time works
+static const uint64_t now = 1500000000;
+
+static void makeRequests(OTP_SecretStore& store, std::vector<Expected>& table)
+{
+    std::mt19937_64 random(1);
+    std::vector<HMAC_SHA1_Midstate> keys(USERS);
+    for(uint64_t user = 0; user < USERS; user++)
+    {
+        uint8_t secret[20];
+        for(uint8_t i = 0; i < 20; i++) secret[i] = random();
+        store.add(user, secret, 20);
+        HMAC_SHA1::midstate(secret, 20, keys[user]);
+    }
+
+    //A different user for every request, so every valid code is used once per round
+    std::vector<uint64_t> users(USERS);
+    for(uint64_t user = 0; user < USERS; user++) users[user] = user;
+    std::shuffle(users.begin(), users.end(), random);
+
+    table.resize(REQUESTS);
+    for(size_t n = 0; n < REQUESTS; n++)
+    {
+        Expected& e = table[n];
+        uint64_t user = users[n];
+        unsigned kind = random() % 20;
+        //16 in 20 current, 2 a step either side, 1 wrong, 1 unknown user
+        int64_t offset = kind == 16 ? -1 : kind == 17 ? 1 : 0;
+        uint64_t step = now / 30 + offset;
+        uint8_t counter[8];
+        for(uint8_t i = 0; i < 8; i++) counter[i] = step >> (56 - 8 * i);
+        uint8_t password[9];
+        otp(password, keys[user], counter);
+
+        e.request.user = user;
+        e.request.time = now;
+        for(uint8_t i = 0; i < 6; i++) e.request.code[i] = password[i];
+        e.request.code[6] = 0;
+        e.result = OTP_VERIFY_OK;
+        if(kind == 18)
+        {
+            e.request.code[0] = '0' + (password[0] - '0' + 1) % 10;
+            e.result = OTP_VERIFY_BAD_CODE;
+        }
+        else if(kind == 19)
+        {
+            e.request.user = USERS + user;
+            e.result = OTP_VERIFY_UNKNOWN_USER;
+        }
+    }
+}
+
+struct Slot
+{
+    OTP_VerifyResult results[BATCH];
+    size_t offset;
+    std::atomic<bool> busy;
+};
+
+int main(int argc, char** argv)
+{
+    unsigned workers = argc > 1 ? atoi(argv[1]) : 0;
+    unsigned producers = argc > 2 ? atoi(argv[2]) : 2;
+    double duration = argc > 3 ? atof(argv[3]) : 3.0;
+    uint8_t window = argc > 4 ? atoi(argv[4]) : 1;
+    if(!producers) producers = 1;
+
+    OTP_SecretStore store;
+    std::vector<Expected> table;
+    makeRequests(store, table);
+    std::vector<OTP_VerifyRequest> requests(REQUESTS);
+    for(size_t i = 0; i < REQUESTS; i++) requests[i] = table[i].request;
+
+    char path[] = "/tmp/otp-verify-XXXXXX";
+    int fd = mkstemp(path);
+    if(fd < 0) return 1;
+    close(fd);
+    Clock::time_point written = Clock::now();
+    bool ok = OTP_SecretDB::write(path, store);
+    double writeTime = milliseconds(written);
+    OTP_SecretDB db;
+    Clock::time_point opened = Clock::now();
+    ok = ok && db.open(path);
+    double openTime = milliseconds(opened);
+    unlink(path);
+    if(!ok)
+    {
+        printf("can't write or open %s\n", path);
+        return 1;
+    }
+    printf("database of %zu users written in %.1f ms, opened in %.3f ms\n", db.size(), writeTime, openTime);
+
+    OTP_ReplayCache used(REQUESTS);
+    OTP_DriftTable drift(USERS);
+    OTP_Verifier verifier(db, window, &used, &drift);
+    OTP_VerifierPool pool(verifier, workers);
+
+    unsigned long valid = 0;
+    for(const Expected& e : table) valid += e.result == OTP_VERIFY_OK;
+    std::atomic<unsigned long> verified(0);
+    std::atomic<unsigned long> accepted(0);
+    std::atomic<unsigned long> wrong(0);
+    std::atomic<bool> stop(false);
+    std::atomic<size_t> nextOffset(0);
+
+    Clock::time_point start = Clock::now();
+    std::vector<std::thread> threads;
+    for(unsigned p = 0; p < producers; p++)
+    {
+        threads.push_back(std::thread([&]{
+            Slot slots[BATCHES_IN_FLIGHT];
+            for(Slot& s : slots) s.busy = false;
+            while(!stop)
+            {
+                bool queued = false;
+                for(Slot& s : slots)
+                {
+                    if(s.busy) continue;
+                    s.busy = true;
+                    s.offset = (nextOffset += BATCH) % REQUESTS;
+                    Slot* slot = &s;
+                    pool.submit(&requests[s.offset], s.results, BATCH, [&, slot]{
+                        unsigned long bad = 0;
+                        unsigned long ok = 0;
+                        for(size_t i = 0; i < BATCH; i++)
+                        {
+                            OTP_VerifyResult r = slot->results[i];
+                            OTP_VerifyResult expected = table[slot->offset + i].result;
+                            ok += r == OTP_VERIFY_OK;
+                            bad += r != expected && !(expected == OTP_VERIFY_OK && r == OTP_VERIFY_REPLAY);
+                        }
+                        wrong += bad;
+                        accepted += ok;
+                        verified += BATCH;
+                        slot->busy = false;
+                    });
+                    queued = true;
+                }
+                if(!queued) std::this_thread::yield();
+            }
+            for(Slot& s : slots) while(s.busy) std::this_thread::yield();
+        }));
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(duration));
+    stop = true;
+    for(std::thread& t : threads) t.join();
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    double rate = verified / elapsed;
+    printf("%u workers, %u producers, %d users, window %u, replay cache, drift table\n", pool.threads(), producers, USERS, window);
+    printf("verifications/sec: %12.0f (target %d)\n", rate, TARGET_RATE);
+    if(wrong)
+    {
+        printf("%lu wrong results\n", (unsigned long)wrong);
+        return 1;
+    }
+    //Every batch of the table was verified at least once
+    if(verified >= REQUESTS && accepted != valid)
+    {
+        printf("%lu of %lu valid codes accepted\n", (unsigned long)accepted, valid);
+        return 1;
+    }
+    printf("all %lu results correct\n", (unsigned long)verified);
+    return 0;
+}